@@ -116,11 +116,12 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+#define TLBSHOOTDOWN_PAGES 16
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	unsigned ts_npages;		/* Over TLBSHOOTDOWN_PAGES: flush all */
+	vaddr_t ts_vaddrs[TLBSHOOTDOWN_PAGES];	/* Pages to invalidate */
+	struct semaphore *ts_done;	/* Posted once the pages are gone */
 };
 
 /*
@@ -158,8 +159,47 @@ struct coremap_entry {
     enum block_state_t blk_state;
     enum use_state_t use_state;
     //Chunk size -> see alis last reciation
+
+    /*
+     * Buddy allocator links. Only meaningful on the first page of a
+     * free block: cm_order is the block's order (it spans 1<<cm_order
+     * pages) and cm_next/cm_prev chain it on that order's free list.
+     * cm_order is -1 on every other page.
+     */
+    int cm_order;
+    int cm_next;
+    int cm_prev;
+
+    /* Number of page table entries mapping this frame (COW sharing) */
+    unsigned cm_refcount;
+
+    /*
+     * Reverse mapping for eviction. A user frame mapped by exactly one
+     * page table records that PTE and the address it maps; shared
+     * frames have cm_pte NULL and are never chosen as victims.
+     */
+    uint32_t *cm_pte;		/* pte_t *, see pagetable.h */
+    vaddr_t cm_uvaddr;
+    bool cm_busy;		/* Being paged out; leave it alone */
+    bool cm_referenced;		/* Second-chance bit for the clock hand */
+
+    /*
+     * Swap slot holding an up-to-date copy of the frame, or -1. A
+     * frame with a slot is clean and can be evicted without any I/O;
+     * the first write to it gives the slot up.
+     */
+    int cm_slot;
+
+    /*
+     * For a page of the kmalloc subpage heap, its struct pageref, so
+     * kfree can find it without searching. NULL for any other page.
+     */
+    void *cm_kheap;
 };
 
+/* Number of buddy free lists; the largest block is 1<<(N-1) pages */
+#define COREMAP_NORDERS 16
+
 extern struct spinlock coremap_spinlock;
 extern int NUM_ENTRIES;
 extern struct coremap_entry *coremap;
@@ -177,11 +177,35 @@ syscall(struct trapframe *tf)
 	    case SYS_execv:
 		err = sys_execv((char *)tf->tf_a0, (char**)tf->tf_a1, &retval);
 		break;
-/*
 	    case SYS_sbrk:
 		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
 		break;
-*/
+	    case SYS_mmap:
+		err = sys_mmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				(int)tf->tf_a2, (int)tf->tf_a3,
+				(const_userptr_t)tf->tf_sp+16, &retval);
+		break;
+	    case SYS_munmap:
+		err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1, &retval);
+		break;
+	    case SYS_madvise:
+		err = sys_madvise((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				(int)tf->tf_a2, &retval);
+		break;
+	    case SYS_mincore:
+		err = sys_mincore((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				(userptr_t)tf->tf_a2, &retval);
+		break;
+	    case SYS_mlock:
+		err = sys_mlock((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1, &retval);
+		break;
+	    case SYS_munlock:
+		err = sys_munlock((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1, &retval);
+		break;
+	    case SYS_getrusage:
+		err = sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1, &retval);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
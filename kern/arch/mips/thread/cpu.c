@@ -38,6 +38,7 @@
 #include <platform/maxcpus.h>
 #include <cpu.h>
 #include <thread.h>
+#include <vm.h>
 
 ////////////////////////////////////////////////////////////
 
@@ -292,6 +293,10 @@ wait(void)
 void
 cpu_idle(void)
 {
+	/* Zero a free page for the VM instead, if it wants one */
+	if (vm_idlezero()) {
+		return;
+	}
 	wait();
         cpu_irqonoff();
 }
@@ -135,6 +135,13 @@ coremap_used_bytes() {
 	return 0;
 }
 
+bool
+vm_idlezero(void)
+{
+	/* dumbvm never frees anything to zero */
+	return false;
+}
+
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
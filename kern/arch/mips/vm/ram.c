@@ -31,6 +31,7 @@
 #include <lib.h>
 #include <vm.h>
 #include <mainbus.h>
+#include "opt-dumbvm.h"
 
 
 vaddr_t firstfree;   /* first free virtual address; set by start.S */
@@ -74,8 +75,9 @@ ram_bootstrap(void)
 	kprintf("%uk physical memory available\n",
 		(lastpaddr-firstpaddr)/1024);
 
-	/* UNCOMMENT FOR ASST#3 */
-//	init_coremap(ramsize, temp); 
+#if !OPT_DUMBVM
+	init_coremap(ramsize, temp);
+#endif
 	firstpaddr = temp;
 }
 
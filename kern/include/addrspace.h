@@ -36,11 +36,54 @@
  */
 
 
+#include <array.h>
 #include <vm.h>
+#include <pagetable.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
 
+struct region{
+	vaddr_t as_vbase;
+	vaddr_t as_vend;
+	paddr_t as_pbase;
+	size_t region_pages;
+	pte_t permissions;	//PTE_READ/PTE_WRITE/PTE_EXEC
+	unsigned region_type;	//REGION_*, below
+	unsigned region_advice;	//MADV_NORMAL/RANDOM/SEQUENTIAL
+
+	/*
+	 * File backing for executable segments and mapped files. Bytes
+	 * [file_vaddr, file_vaddr + filesize) come from vnode at
+	 * file_offset and are read in when first touched; the rest of
+	 * the region is zero-fill. vnode is NULL for anonymous memory.
+	 */
+	struct vnode *vnode;
+	off_t file_offset;
+	vaddr_t file_vaddr;
+	size_t filesize;
+
+	/*
+	 * Sequential fault detector for fault-around: the page a
+	 * sequential sweep would fault on next, and how many pages were
+	 * mapped ahead last time.
+	 */
+	vaddr_t ra_next;
+	unsigned ra_window;
+};
+
+#define REGION_SEGMENT	0	/* From the executable */
+#define REGION_HEAP	1
+#define REGION_STACK	2
+#define REGION_MMAP	3
+
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region, ASINLINE);
+DEFARRAY(region, ASINLINE);
+
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -61,28 +104,49 @@ struct addrspace {
 #else
 	/* Put stuff here for your VM system */
 	
-	/* Region Permission */
-	struct region *region_table;	//for code & text	
+	/*
+	 * Every region, sorted by as_vbase and never overlapping, so a
+	 * fault finds its region (and with it the permissions and file
+	 * backing) by binary search. The stack and heap are in there
+	 * too; these point at them.
+	 */
+	struct regionarray as_regions;
 	struct region *stack_region;	//stack
 	struct region *heap_region;	//heap
-	struct page_entry *page_table;
+	struct pagetable *page_table;
+
+	/*
+	 * Software ASID. A CPU whose TLB was last loaded under this
+	 * ASID can switch back to us without flushing. It is replaced
+	 * whenever we take a mapping away, which makes every other CPU
+	 * flush the next time we run there.
+	 */
+	unsigned as_asid;
+
+	/*
+	 * CPUs (by c_number) that have run us under as_asid, so that
+	 * shootdowns can skip the rest. Only changed by the CPU we are
+	 * running on.
+	 */
+	uint32_t as_cpumask;
+
+	/* Most the stack may grow to, in bytes */
+	size_t as_stackmax;
+
+	/* Resident set and fault counters, under coremap_spinlock */
+	struct vm_usage as_usage;
 	
 #endif
 };
 
-struct region{
-	vaddr_t as_vbase;
-	vaddr_t as_vend;
-	paddr_t as_pbase;
-	size_t region_pages;
-	struct region *next;
-};
+/* The region holding VA, or NULL; O(log n) in the number of regions */
+struct region * as_region_lookup(struct addrspace *as, vaddr_t va);
 
-/* Subroutine for valid_address */
-bool region_check(vaddr_t faultaddress, struct region *);
-
-/* Checks that the address is either in stack, code, text, or heap */
-int valid_address(vaddr_t faultaddress, struct addrspace *);
+/*
+ * Checks that the address is either in stack, code, text, heap or an
+ * mmap region, and hands back the region it is in.
+ */
+int valid_address(vaddr_t faultaddress, struct addrspace *, struct region **ret);
 /*
  * Functions in addrspace.c:
  *
@@ -139,12 +203,52 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
-/***** Region functions ******/
+/*
+ * as_define_backing - attach file data to the region containing VADDR
+ *                so it can be paged in lazily. Takes a reference to V.
+ */
+int               as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                                    struct vnode *v, off_t offset,
+                                    size_t filesize);
 
-/* Helper for as_destroy */
-struct region * pop_region(struct region **);
+/*
+ * as_map -       map LEN (page-aligned) bytes with permissions PERMS.
+ *                With FIXED the mapping goes at *ADDR, replacing
+ *                earlier mappings there; otherwise it goes in the
+ *                highest gap below the stack and *ADDR is set to it.
+ *                Backed by FILESIZE bytes of V at OFFSET, then zeros;
+ *                V may be NULL. Takes a reference to V.
+ *
+ * as_unmap -     remove mappings in [START, END), splitting any that
+ *                straddle it. Must be called on the current address
+ *                space.
+ *
+ * as_heap_limit - how far the heap can grow before hitting a mapping
+ *                or the stack.
+ */
+int               as_map(struct addrspace *as, vaddr_t *addr, size_t len,
+                         pte_t perms, struct vnode *v, off_t offset,
+                         size_t filesize, bool fixed);
+int               as_unmap(struct addrspace *as, vaddr_t start, vaddr_t end);
 
-int push_region(struct region **region_table, vaddr_t vaddr, vaddr_t vaddr_end,int npages);
+/*
+ * as_range_mapped - true if every page of [START, END) is in a region.
+ *
+ * as_advise -    record MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL for
+ *                fault-around, for every region [START, END) touches.
+ */
+bool              as_range_mapped(struct addrspace *as, vaddr_t start,
+                                  vaddr_t end);
+void              as_advise(struct addrspace *as, vaddr_t start, vaddr_t end,
+                            unsigned advice);
+
+/*
+ * as_grow_stack - extend the stack down to cover VA, which faulted.
+ *                EFAULT if VA isn't in the room kept for the stack, or
+ *                is in the guard page at the bottom of it.
+ */
+int               as_grow_stack(struct addrspace *as, vaddr_t va);
+vaddr_t           as_heap_limit(struct addrspace *as);
 
 /*
  * Functions in loadelf.c
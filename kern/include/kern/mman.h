@@ -0,0 +1,27 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), shared by the kernel and userland.
+ */
+
+/* Page protection */
+#define PROT_NONE     0x0      /* No access */
+#define PROT_READ     0x1      /* Pages can be read */
+#define PROT_WRITE    0x2      /* Pages can be written */
+#define PROT_EXEC     0x4      /* Pages can be executed */
+
+/* Mapping flags; exactly one of MAP_SHARED and MAP_PRIVATE is required */
+#define MAP_SHARED    0x0001   /* Share changes (read-only mappings only) */
+#define MAP_PRIVATE   0x0002   /* Changes are private */
+#define MAP_FIXED     0x0010   /* Map at exactly the address given */
+#define MAP_ANON      0x1000   /* Zero-filled memory, not backed by a file */
+
+/* Advice for madvise() */
+#define MADV_NORMAL     0      /* No particular pattern */
+#define MADV_RANDOM     1      /* Don't read ahead */
+#define MADV_SEQUENTIAL 2      /* Read ahead as far as allowed */
+#define MADV_WILLNEED   3      /* Page the range in now */
+#define MADV_DONTNEED   4      /* Throw the contents away now */
+
+#endif /* _KERN_MMAN_H_ */
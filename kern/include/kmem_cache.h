@@ -0,0 +1,56 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+#include <spinlock.h>
+
+/*
+ * Object caches for frequently created kernel structures.
+ *
+ * A cache hands out objects of one size. An object leaves its
+ * constructor (if any) in a ready-to-use state, and must be returned
+ * to kmem_cache_free in that same state; the cache then keeps up to
+ * maxfree of them around, so the next kmem_cache_alloc skips both
+ * kmalloc and the constructor. Beyond that, or when the caches are
+ * reaped, objects go through the destructor and back to kfree.
+ *
+ * Caches are defined statically with KMEM_CACHE_INITIALIZER. CTOR
+ * returns 0 or an error code, and may be NULL; so may DTOR.
+ *
+ * Functions:
+ *     kmem_cache_alloc   - get an object, or NULL if out of memory.
+ *     kmem_cache_free    - give one back.
+ *     kmem_cache_reap    - destroy every cached object in every cache;
+ *                          returns how many there were. The caller
+ *                          must be able to run the destructors.
+ *     kmem_cache_printstats - print hit counts for each cache.
+ */
+
+#define KMEM_CACHE_MAXFREE	32
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	unsigned kc_maxfree;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;
+	unsigned kc_nfree;
+	void *kc_free[KMEM_CACHE_MAXFREE];
+	unsigned kc_hits;		/* allocs served from kc_free */
+	unsigned kc_misses;		/* allocs that had to construct */
+
+	bool kc_listed;			/* on the list kmem_cache_reap walks */
+	struct kmem_cache *kc_next;
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, maxfree, ctor, dtor) \
+	{ name, size, maxfree, ctor, dtor, SPINLOCK_INITIALIZER, \
+	  0, { NULL }, 0, 0, false, NULL }
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_cache_reap(void);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEM_CACHE_H_ */
@@ -125,7 +125,15 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_bootstrap sizes the heap's bookkeeping for the RAM found at
+ * boot; it must run after ram_bootstrap and before the first kmalloc.
+ *
+ * kheap_profstart turns on allocation-site profiling (or restarts it),
+ * and kheap_printprofile shows it; kheap_nextgeneration also marks the
+ * point the profile's rates and growth are measured from.
  */
+void kheap_bootstrap(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
@@ -134,6 +142,9 @@ unsigned long kheap_getused(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+int kheap_profstart(void);
+void kheap_profstop(void);
+void kheap_printprofile(void);
 
 /*
  * C string functions.
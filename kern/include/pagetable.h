@@ -1,64 +1,96 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
 #include <types.h>
 #include <vm.h>
 
-/* Permissions */
-#define NONE		'0'
-#define RD		'1'
-#define	WR		'2'
-#define	EX		'3'
-#define	RD_WR		'4'
-#define	RD_EX		'5'
-#define	WR_EX		'6'
-#define	ALL		'7'
-
-/* Page State */
-#define	MEM		'0'
-#define	DISK		'1'
-	
-/* Page Valid Bit */
-#define	VALID		'0'
-#define INVALID 	'1'
-
-/* Page Referenced */
-#define	NO_RECENT_WR	'0'
-#define RECENT_WR	'1'
-
-/* Indices into Metadata ARRAY */
-#define PERMISSION	'0' 
-#define STATE		'1'
-#define	VALID_BIT	'2'
-#define REFERENCED	'3'
-	
-typedef struct page_entry{
-	vaddr_t vpn; 	//top 20 bits
-	paddr_t pas; 	//physical page location on disk
-	struct page_entry *next;
-
-}page_entry;
-
-
-//page_entry * pagetable_init(void); 
-
-/* Print Linked List */
-void print_list(page_entry *head);
-
-/* Add To Beginning of Linked List */
-int push_pte(page_entry **head, vaddr_t vpn);
-struct page_entry * vpn_check(vaddr_t vpn, page_entry *pt);
-
-page_entry * find_vaddr(page_entry *, vaddr_t va);
-
-/* Remove Specific Page Entry From Linked List
- *  (tbd what value will be passed) 
+/*
+ * Two-level page table, split 10/10/12 the same way as the MIPS
+ * virtual address: the top 10 bits index the directory, the next 10
+ * bits index a second-level table, and the low 12 are the page offset.
+ * Each level is exactly one page. Second-level tables are allocated
+ * the first time something in their 4M of address space is mapped.
+ */
+
+typedef uint32_t pte_t;
+
+#define PT_ENTRIES	1024
+#define PT_L1_INDEX(va)	(((va) >> 22) & (PT_ENTRIES - 1))
+#define PT_L2_INDEX(va)	(((va) >> 12) & (PT_ENTRIES - 1))
+
+/*
+ * A PTE holds the physical frame in its top 20 bits, like TLBLO, and
+ * flags in the low 12. A page that has been swapped out keeps its swap
+ * slot number in the frame bits instead.
+ *
+ * Once a page is resident or swapped, its PTE only changes with
+ * coremap_spinlock held, since the pageout code edits other processes'
+ * tables. PTE_BUSY marks a page on its way to or from swap; anyone else
+ * who wants it sleeps until the bit goes away.
+ */
+#define PTE_FRAME	0xfffff000
+#define PTE_VALID	0x00000001	/* Frame is resident */
+#define PTE_DIRTY	0x00000002	/* Page has been written */
+#define PTE_REF		0x00000004	/* Page was referenced recently */
+#define PTE_COW		0x00000008	/* Frame shared after fork; copy on write */
+#define PTE_SWAPPED	0x00000080	/* Page lives in swap slot PTE_SLOT() */
+#define PTE_BUSY	0x00000100	/* Page is in transit */
+#define PTE_WIRED	0x00000200	/* mlock()ed; never evicted */
+
+/* Permissions, taken from the region the page belongs to */
+#define PTE_READ	0x00000010
+#define PTE_WRITE	0x00000020
+#define PTE_EXEC	0x00000040
+#define PTE_PERMS	(PTE_READ | PTE_WRITE | PTE_EXEC)
+
+#define PTE_PADDR(pte)	((paddr_t)((pte) & PTE_FRAME))
+#define PTE_SLOT(pte)	((unsigned)((pte) >> 12))
+#define PTE_MKSLOT(slot)	((pte_t)(slot) << 12)
+
+struct pagetable {
+	pte_t *pt_dir[PT_ENTRIES];
+};
+
+/* Create an empty page table */
+struct pagetable *pagetable_create(void);
+
+/* Free every resident frame, swap slot and second-level table */
+void pagetable_destroy(struct pagetable *pt);
+
+/*
+ * Find the PTE for VA. If CREATE is set, a missing second-level table
+ * is allocated; otherwise (or if that allocation fails) NULL comes back.
  */
-void remove(page_entry **head, vaddr_t va);
+pte_t *pagetable_lookup(struct pagetable *pt, vaddr_t va, bool create);
 
-int concat_permissions(int read, int write, int exec);
-int * get_permissions(int concat);
+/*
+ * Make NEW a copy of OLD. Frames and swap slots are shared rather than
+ * duplicated: each gains a reference, and writable pages are marked
+ * PTE_COW in both tables. The caller must flush stale writable TLB
+ * entries for OLD. The shared pages are added to USAGE, NEW's counters.
+ */
+int pagetable_copy(struct pagetable *old, struct pagetable *new,
+		   struct vm_usage *usage);
+
+/*
+ * Unmap and free the pages in [START, END), taking them off USAGE. The
+ * caller is responsible for getting rid of any TLB entries for them.
+ */
+void pagetable_unmap_range(struct pagetable *pt, vaddr_t start, vaddr_t end,
+			   struct vm_usage *usage);
 
-page_entry * destroy_pagetable(page_entry *);
+/* Convert as_define_region-style flags to PTE permission bits */
+pte_t pte_permissions(int readable, int writeable, int executable);
 
-/* Pop's the head off and updates it,
- * helper function for destroy_pagetable 
+/*
+ * Per-PTE reference handling, done in vm.c under coremap_spinlock.
+ * vm_pte_release drops whatever N consecutive PTEs refer to and zeroes
+ * them; vm_pte_share makes DST[0..N) share SRC[0..N) copy-on-write.
+ * Both wait out pages that are in transit, and keep USAGE (the
+ * counters for PTES, or NULL if they don't matter; or for DST) up to
+ * date.
  */
-page_entry * pop(page_entry **head);
+void vm_pte_release(pte_t *ptes, unsigned n, struct vm_usage *usage);
+void vm_pte_share(pte_t *src, pte_t *dst, unsigned n, struct vm_usage *usage);
+
+#endif /* _PAGETABLE_H_ */
@@ -17,3 +17,11 @@ pid_t sys_waitpid(pid_t pid, int *status, int options, int32_t *retval);
 int sys_execv(char* progname, char** args, int *retval);
 char * concat_null(char * str, size_t buflen);
 int sys_sbrk(intptr_t amount, int *retval);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags,
+	     const_userptr_t stackargs, int *retval);
+int sys_munmap(vaddr_t addr, size_t len, int *retval);
+int sys_madvise(vaddr_t addr, size_t len, int advice, int *retval);
+int sys_mincore(vaddr_t addr, size_t len, userptr_t vec, int *retval);
+int sys_mlock(vaddr_t addr, size_t len, int *retval);
+int sys_munlock(vaddr_t addr, size_t len, int *retval);
+int sys_getrusage(int who, userptr_t usage, int *retval);
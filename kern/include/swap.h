@@ -0,0 +1,27 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space on the raw lhd1 device, in page-sized slots. Slots are
+ * reference counted like frames so that a page that was swapped out
+ * before fork can be shared by parent and child.
+ */
+
+/* Attach the swap device. Without one, the VM just runs out of RAM. */
+void swap_bootstrap(void);
+
+/* True if swap_bootstrap found a device */
+bool swap_enabled(void);
+
+/* Grab a free slot with one reference. Returns ENOSPC when full. */
+int swap_alloc(unsigned *slot);
+
+/* Add or drop a reference; the slot is free again at zero */
+void swap_incref(unsigned slot);
+void swap_free(unsigned slot);
+
+/* Page-sized transfers between a slot and physical frame PA */
+int swap_in(unsigned slot, paddr_t pa);
+int swap_out(unsigned slot, paddr_t pa);
+
+#endif /* _SWAP_H_ */
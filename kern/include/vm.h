@@ -61,6 +61,28 @@ void free_pages(unsigned int addr, int index);
 void free_kpages(vaddr_t addr);
 void free_upages(paddr_t addr);
 
+/*
+ * User frames are reference counted. alloc_upages hands out a frame
+ * with one reference; free_upages drops one and only frees the frame
+ * when the last reference goes away. When memory runs out, both
+ * alloc_kpages and alloc_upages page something out to swap, so they
+ * may sleep unless called with a spinlock held.
+ *
+ * When there is no physically contiguous run for a multi-page
+ * alloc_kpages, the pages come from anywhere and are mapped together
+ * in kseg2 instead. Such memory is not physically contiguous, and its
+ * physical address can't be had by subtracting MIPS_KSEG0.
+ */
+
+/*
+ * Per-page back-pointer for kmalloc (cm_kheap): set it for the kseg0
+ * page holding VA, or read it back. Reading takes no lock, so it is
+ * only good for pages the caller knows won't change hands meanwhile.
+ * Addresses outside the coremap read as NULL. Not in dumbvm.
+ */
+void coremap_setkheap(vaddr_t va, void *ref);
+void *coremap_getkheap(vaddr_t va);
+
 /* Get ppages, subfunction for alloc_kpages */
 paddr_t get_ppages(unsigned npages);
 
@@ -74,6 +96,124 @@ void init_coremap(size_t ramsize, paddr_t firstpaddr);
  */
 unsigned int coremap_used_bytes(void);
 
+/*
+ * Page cleaner. A kernel thread writes dirty user pages to swap ahead
+ * of time, trying to keep at least vm_cleaner_lowat frames either free
+ * or clean, vm_cleaner_batch pages per pass. Both can be changed from
+ * the menu.
+ */
+extern unsigned vm_cleaner_lowat;
+extern unsigned vm_cleaner_batch;
+
+/*
+ * Fault-around. A region whose faults keep landing on the page after
+ * the last one mapped gets up to vm_faultaround_max neighbouring pages
+ * brought in and loaded into the TLB per fault, doubling from one each
+ * time the pattern holds. Any other fault resets it. 0 turns it off.
+ */
+extern unsigned vm_faultaround_max;
+
+/*
+ * Stack size limit in pages for new address spaces; forks inherit
+ * their parent's. Stacks grow on demand below that.
+ */
+extern unsigned vm_stack_maxpages;
+
+/*
+ * Zero pool. Idle CPUs keep up to vm_zeropool_target free frames
+ * zeroed ahead of time for zero-fill faults. vm_idlezero zeroes one
+ * and returns true if the pool was short; cpu_idle calls it.
+ */
+extern unsigned vm_zeropool_target;
+bool vm_idlezero(void);
+
+struct vm_stats {
+	unsigned vs_evictions;		/* Pages pushed out of RAM */
+	unsigned vs_swapins;		/* Pages read back from swap */
+	unsigned vs_fault_stalls;	/* Evictions that had to write first */
+	unsigned vs_cleaned;		/* Pages written by the cleaner */
+	unsigned vs_cleaner_wakeups;	/* Times the cleaner was prodded */
+	unsigned vs_shootdowns;		/* Shootdown rounds that sent IPIs */
+	unsigned vs_shootdown_ipis;	/* IPIs sent in those rounds */
+	unsigned vs_faultaround;	/* Pages brought in ahead of a fault */
+	unsigned vs_faultaround_tlb;	/* Neighbours loaded into the TLB */
+	unsigned vs_zeroed;		/* Frames zeroed by idle CPUs */
+	unsigned vs_zero_hits;		/* Zero-fills served from the pool */
+	unsigned vs_zero_misses;	/* Zero-fills that had to bzero */
+};
+
+extern struct vm_stats vm_stats;
+
+/*
+ * Per-address-space paging counters, kept in struct addrspace. They
+ * only change under coremap_spinlock, on paths that hold it anyway.
+ * Swap slots shared after fork count against every sharer.
+ */
+struct vm_usage {
+	unsigned vu_resident;		/* Pages in RAM */
+	unsigned vu_maxresident;	/* High-water mark of vu_resident */
+	unsigned vu_swapped;		/* Pages in swap */
+	unsigned vu_minflt;		/* Page-ins that needed no I/O */
+	unsigned vu_majflt;		/* Page-ins from swap or a file */
+	unsigned vu_cowbreaks;		/* Frames copied for a COW write */
+	unsigned vu_evicted;		/* Pages pushed out to swap */
+};
+
+struct addrspace;
+
+/*
+ * Application-directed paging, for madvise and friends. AS must be
+ * the current address space and [START, END) lie within its regions.
+ *
+ * vm_populate - page everything in; with WIRE, also lock it in RAM
+ *               (EAGAIN once half of RAM is wired). If wiring fails,
+ *               the pages this call wired are unwired again; pages
+ *               that were already wired stay that way.
+ * vm_unwire   - undo WIRE.
+ * vm_discard  - drop the pages without writing them anywhere, so the
+ *               next touch sees zeros or the file again. EINVAL if
+ *               any are wired.
+ * vm_mincore  - VEC[i] = 1 if page i is resident, else 0.
+ */
+int vm_populate(struct addrspace *as, vaddr_t start, vaddr_t end, bool wire);
+void vm_unwire(struct addrspace *as, vaddr_t start, vaddr_t end);
+int vm_discard(struct addrspace *as, vaddr_t start, vaddr_t end);
+void vm_mincore(struct addrspace *as, vaddr_t start, vaddr_t end,
+		unsigned char *vec);
+
+/* Snapshot AS's counters; AS is struct addrspace * */
+void vm_getusage(struct addrspace *as, struct vm_usage *ret);
+
+/* Per-CPU TLB refill counters, one set per CPU */
+struct vm_cpustats {
+	unsigned vc_pagefaults;		/* Faults that had to bring a page in */
+	unsigned vc_tlbmisses;		/* Refills for a page not in the TLB */
+	unsigned vc_tlbupdates;		/* Entries rewritten in place */
+	unsigned vc_tlbevicts;		/* Live entries thrown out for room */
+	unsigned vc_flushes;		/* as_activate had to flush */
+	unsigned vc_flushes_skipped;	/* as_activate found our entries */
+};
+
+/* Print vm_stats, the cleaner tunables and the per-CPU TLB counters */
+void vm_printstats(void);
+
+/*
+ * Invalidate this CPU's TLB, but for kernel virtual area (kseg2)
+ * entries, which are the same in every address space.
+ */
+void vm_tlbflush(void);
+
+/*
+ * Software ASIDs (see struct addrspace). vm_newasid hands out a fresh
+ * one. vm_tlbactivate flushes this CPU's TLB unless it already holds
+ * AS's entries. vm_tlbretire is for after removing or downgrading
+ * mappings in [start, end) of AS, which must be the current address
+ * space: it gives AS a new ASID and drops the range from this TLB.
+ */
+unsigned vm_newasid(void);
+void vm_tlbactivate(struct addrspace *as);
+void vm_tlbretire(struct addrspace *as, vaddr_t start, vaddr_t end);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
@@ -40,14 +40,17 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <vm.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
 #include <prompt.h>
+#include <kmem_cache.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-synchprobs.h"
 #include "opt-automationtest.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -490,6 +493,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 
 	return 0;
 }
@@ -501,11 +505,51 @@ cmd_kheapused(int nargs, char **args)
 	(void)nargs;
 	(void)args;
 
+	/*
+	 * Objects held in the kmem caches (and whatever their
+	 * constructors allocated) would look like leaks to the
+	 * before-and-after comparisons this is used for.
+	 */
+	kmem_cache_reap();
 	kheap_printused();
 
 	return 0;
 }
 
+#if !OPT_DUMBVM
+/*
+ * Command for per-process paging counters. Like the waitpid code, this
+ * trusts proc_table not to change under it.
+ */
+static
+int
+cmd_vmps(int nargs, char **args)
+{
+	struct vm_usage vu;
+	struct proc *p;
+	int i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("  pid   rss  maxrss  swapped  minflt  majflt    cow  evicted"
+		"  name\n");
+	for (i=0; i<PROC_MAX; i++) {
+		p = proc_table[i];
+		if (p == NULL || p->p_addrspace == NULL) {
+			continue;
+		}
+		vm_getusage(p->p_addrspace, &vu);
+		kprintf("%5d %5u %7u %8u %7u %7u %6u %8u  %s\n", p->pid,
+			vu.vu_resident, vu.vu_maxresident, vu.vu_swapped,
+			vu.vu_minflt, vu.vu_majflt, vu.vu_cowbreaks,
+			vu.vu_evicted, p->p_name);
+	}
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -535,6 +579,65 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		kheap_printprofile();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		result = kheap_profstart();
+		if (result) {
+			kprintf("khprof: %s\n", strerror(result));
+			return result;
+		}
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		kheap_profstop();
+	}
+	else {
+		kprintf("Usage: khprof [on|off]\n");
+	}
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printstats();
+	}
+	else if (nargs == 3 && !strcmp(args[1], "lowat")) {
+		vm_cleaner_lowat = atoi(args[2]);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "batch")) {
+		vm_cleaner_batch = atoi(args[2]);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "faultaround")) {
+		vm_faultaround_max = atoi(args[2]);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "zeropool")) {
+		vm_zeropool_target = atoi(args[2]);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "stack")) {
+		vm_stack_maxpages = atoi(args[2]);
+	}
+	else {
+		kprintf("Usage: vm [lowat pages | batch pages | "
+			"faultaround pages | zeropool pages | "
+			"stack pages]\n");
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -602,6 +705,7 @@ static const char *testmenu[] = {
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
 	"[km5] kmalloc coremap alloc test    ",
+	"[cb]  copyin/copyout benchmark      ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -684,8 +788,15 @@ static const char *mainmenu[] = {
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
 	"[khu] Kernel heap usage             ",
+#if !OPT_DUMBVM
+	"[vmps] Per-process paging counters  ",
+#endif
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profile        ",
+#if !OPT_DUMBVM
+	"[vm] Paging stats and tunables      ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -739,8 +850,15 @@ static struct {
 	/* stats */
 	{ "kh",         cmd_kheapstats },
 	{ "khu",        cmd_kheapused },
+#if !OPT_DUMBVM
+	{ "vmps",       cmd_vmps },
+#endif
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprofile },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -752,6 +870,7 @@ static struct {
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
 	{ "km5",	kmalloctest5 },
+	{ "cb",		copybench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
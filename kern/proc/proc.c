@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
@@ -51,6 +52,7 @@
 #include <kern/unistd.h>
 #include <vfs.h>
 #include <file_syscall.h>
+#include <kmem_cache.h>
 
 int pid_stack[PID_MAX / 2];
 int stack_index;
@@ -60,6 +62,44 @@ int stack_index;
  */
 struct proc *kproc;
 
+/*
+ * Proc structures are kept with their lock, cv and p_lock already set
+ * up; proc_destroy hands them back that way.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->lock = lock_create("proc lock");
+	if (proc->lock == NULL) {
+		return ENOMEM;
+	}
+	proc->cv = cv_create("proc cv");
+	if (proc->cv == NULL) {
+		lock_destroy(proc->lock);
+		return ENOMEM;
+	}
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+	cv_destroy(proc->cv);
+	lock_destroy(proc->lock);
+}
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc), 16,
+			       proc_ctor, proc_dtor);
+
 /*
  * Create a proc structure.
  */
@@ -69,18 +109,17 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 	bool err;
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -105,10 +144,6 @@ proc_create(const char *name)
 	proc->ppid = 0;
 
 	/* Setting up what I think would be defaults */
-	
-	proc->lock = lock_create("proc lock");
-	proc->cv = cv_create("proc cv");
-
 
 	proc->exited = false;
 	
@@ -116,7 +151,8 @@ proc_create(const char *name)
 	
 	err = proc_table_append(proc);
 	if(!err){
-		kfree(proc);
+		kfree(proc->p_name);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 	
@@ -214,17 +250,12 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
-	
+
 	proc_table_remove(proc);
 	pid_stack_push(proc->pid);
 
-	cv_destroy(proc->cv);
-	lock_destroy(proc->lock);
-	
-	kfree(proc->p_addrspace);	
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 }
 /*Add to ProcTable*/
 bool proc_table_append(struct proc *proc){
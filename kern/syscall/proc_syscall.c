@@ -11,11 +11,16 @@
 #include <lib.h>
 #include <copyinout.h>
 #include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <kern/stat.h>
 #include <vfs.h>
 #include <syscall.h>
 #include <pagetable.h>
 #include <vm.h>
 #include <mips/tlb.h>
+#include "opt-dumbvm.h"
 
 int pid_stack[PID_MAX/2];
 int stack_index;
@@ -387,17 +392,17 @@ int sys_execv(char* progname, char** args, int *retval){
 		return ENOMEM;
 	}
 
-	//get old adderspace and destroy it
-	struct addrspace *oldas = curproc->p_addrspace;
+	/*
+	 * Switch to it and activate it, and only then destroy the old
+	 * one: until proc_setas, a context switch would still activate
+	 * the old address space.
+	 */
+	struct addrspace *oldas = proc_setas(as);
+	as_activate();
 	if(oldas != NULL){
 		as_destroy(oldas);
 	}
 
- 
-	/* Switch to it and activate it. */
-	proc_setas(as);
-	as_activate();
-
 	/* Load the executable. */
 	result = load_elf(v, &entrypoint);
 	if (result) {
@@ -482,7 +487,12 @@ char * concat_null(char * str, size_t buflen){
 	return temp;
 }
 
+#if !OPT_DUMBVM
 /*
+ * Move the end of the heap by AMOUNT bytes and return the old end.
+ * Growing only moves as_vend; vm_fault fills pages in as they are
+ * touched. Shrinking hands back every page wholly above the new end.
+ */
 int sys_sbrk(intptr_t amount, int *retval){
 //	"break" is the end of heap region, retval set to old "break"
 
@@ -492,97 +502,340 @@ int sys_sbrk(intptr_t amount, int *retval){
 	//bounds of current heap region
 	vaddr_t heap_s = as->heap_region->as_vbase;
 	vaddr_t heap_e = as->heap_region->as_vend;
-	vaddr_t new_heap_e = 0;
-	
-	//check if amount is page_aligned
+	vaddr_t new_heap_e = heap_e + amount;
+
+	//check if amount is word aligned
 	if(amount % 4){
 		*retval = -1;
 		return EINVAL;
-	}	 
+	}
 
 	//check if amount will move heap_e below heap_s
-	if((amount + heap_e) < heap_s){
+	if(amount < 0 && ((vaddr_t)-amount > heap_e - heap_s)){
 		*retval = -1;
 		return EINVAL;
 	}
 
-	//check if amount will move heap_e into stack region
-	vaddr_t stack_s = as->stack_region->as_vbase;
-	
-	if( amount > 0 && (amount + heap_e) > stack_s){
+	//check if amount will move heap_e into a mapping or the stack
+	vaddr_t limit = as_heap_limit(as);
+	if(amount > 0 && ((vaddr_t)amount > limit - heap_e)){
 		*retval = -1;
 		return ENOMEM;
 	}
-	else {
-		if(amount < 0){
-			if(((long)heap_e + amount) < (long)heap_s){
-				*retval = -1;
-				return EINVAL;
-			}
+
+	as->heap_region->as_vend = new_heap_e;
+	if(amount < 0){
+		vaddr_t start = ROUNDUP(new_heap_e, PAGE_SIZE);
+		vaddr_t end = ROUNDUP(heap_e, PAGE_SIZE);
+
+		if(start < end){
+			/* Other CPUs flush when they next activate us */
+			vm_tlbretire(as, start, end);
+			pagetable_unmap_range(as->page_table, start, end,
+					      &as->as_usage);
 		}
 	}
 
-	int i = 0;
-	int npages = 0;
-	int tlb_index = 0;
-	vaddr_t vpn = 0;
-//	paddr_t pas = 0;
-	struct page_entry * pg_entry;
-	new_heap_e = heap_e;
-	//negative amount
-	if(amount < 0){
-		//amount changed to postive to get postive number of pages.
-		amount *= -1;
-		npages = amount / PAGE_SIZE;
-
-		for(i = 0 ; i < npages; i++){
-					
-			new_heap_e -= PAGE_SIZE;
-			vpn = new_heap_e & PAGE_FRAME;
-			
-			//update tlb
-			tlb_index = tlb_probe(vpn,0);
-			
-			if(tlb_index > 0){
-			
+	*retval = heap_e;
+	return 0;
+}
+
+/*
+ * mmap(addr, len, prot, flags, fd, offset). The last two arguments
+ * don't fit in registers and are fetched from the user stack at
+ * STACKARGS, the 64-bit offset doubleword-aligned after fd.
+ *
+ * SFS has no page cache, so a file mapping is a private snapshot read
+ * in page by page on fault, the same way executables are loaded.
+ * MAP_SHARED is therefore only allowed read-only.
+ */
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags,
+	     const_userptr_t stackargs, int *retval){
+	struct addrspace *as = curproc->p_addrspace;
+	struct file_handle *fh;
+	struct vnode *v = NULL;
+	struct stat st;
+	size_t filesize = 0;
+	off_t offset = 0;
+	int fd, err;
+
+	*retval = -1;
 
-			tlb_write(TLBHI_INVALID(tlb_index),TLBLO_INVALID(),tlb_index);
-			pg_entry = vpn_check(vpn, as->page_table);
-			free_upages(pg_entry->pas);
+	if(len == 0 || len > USERSPACETOP){
+		return EINVAL;
+	}
+	len = ROUNDUP(len, PAGE_SIZE);
+	if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0)){
+		return EINVAL;
+	}
+	if((flags & MAP_SHARED) && (prot & PROT_WRITE)){
+		return ENOTSUP;
+	}
+
+	if(!(flags & MAP_ANON)){
+		err = copyin(stackargs, &fd, sizeof(fd));
+		if(err){
+			return err;
+		}
+		err = copyin(stackargs + 8, &offset, sizeof(offset));
+		if(err){
+			return err;
 		}
+		if(offset < 0 || offset % PAGE_SIZE != 0){
+			return EINVAL;
+		}
+		if(fd < 0 || fd >= OPEN_MAX || curproc->file_table[fd] == NULL){
+			return EBADF;
+		}
+		fh = curproc->file_table[fd];
+		if((fh->flags & O_ACCMODE) == O_WRONLY){
+			return EACCES;
+		}
+		v = fh->vnode;
+		err = VOP_MMAP(v);
+		if(err){
+			return err;
+		}
+		err = VOP_STAT(v, &st);
+		if(err){
+			return err;
+		}
+		if(st.st_size > offset){
+			filesize = len;
+			if(st.st_size - offset < (off_t)len){
+				filesize = st.st_size - offset;
+			}
+		}
+	}
+
+	err = as_map(as, &addr, len,
+		     pte_permissions(prot & PROT_READ, prot & PROT_WRITE,
+				     prot & PROT_EXEC),
+		     v, offset, filesize, (flags & MAP_FIXED) != 0);
+	if(err){
+		return err;
+	}
+	*retval = addr;
+	return 0;
+}
+
+int sys_munmap(vaddr_t addr, size_t len, int *retval){
+	struct addrspace *as = curproc->p_addrspace;
+	int err;
+
+	*retval = -1;
+	if(addr % PAGE_SIZE != 0 || len == 0 ||
+	   addr + len < addr || addr + len > USERSPACETOP){
+		return EINVAL;
+	}
+	err = as_unmap(as, addr, ROUNDUP(addr + len, PAGE_SIZE));
+	if(err){
+		return err;
+	}
+	*retval = 0;
+	return 0;
+}
+
+/*
+ * Check an address range passed to the madvise family: ADDR must be
+ * page-aligned and every page up to ADDR+LEN mapped. Hands back the
+ * page-aligned end.
+ */
+static
+int
+check_mrange(struct addrspace *as, vaddr_t addr, size_t len, vaddr_t *end){
+	if(addr % PAGE_SIZE != 0 || addr + len < addr ||
+	   addr + len > USERSPACETOP){
+		return EINVAL;
+	}
+	*end = ROUNDUP(addr + len, PAGE_SIZE);
+	if(!as_range_mapped(as, addr, *end)){
+		return ENOMEM;
+	}
+	return 0;
+}
 
+int sys_madvise(vaddr_t addr, size_t len, int advice, int *retval){
+	struct addrspace *as = curproc->p_addrspace;
+	vaddr_t end;
+	int err;
 
+	*retval = -1;
+	err = check_mrange(as, addr, len, &end);
+	if(err){
+		return err;
+	}
+	switch(advice){
+	    case MADV_NORMAL:
+	    case MADV_RANDOM:
+	    case MADV_SEQUENTIAL:
+		as_advise(as, addr, end, advice);
+		break;
+	    case MADV_WILLNEED:
+		/* Only a hint, so failing part way is no error */
+		(void)vm_populate(as, addr, end, false);
+		break;
+	    case MADV_DONTNEED:
+		err = vm_discard(as, addr, end);
+		if(err){
+			return err;
 		}
-		
-		*retval = heap_e;
-		curproc->p_addrspace->heap_region->as_vend -= amount;
-		
-	
+		break;
+	    default:
+		return EINVAL;
 	}
-	
-	//positive amount
-	
-	else{
+	*retval = 0;
+	return 0;
+}
 
-	        int err = 0;
-		npages = amount / PAGE_SIZE;
-		
-		for(i = 0 ; i < npages; i++){
-					
-			new_heap_e += PAGE_SIZE;
-			vpn = new_heap_e & PAGE_FRAME;
-			err = push_pte(&(as->page_table),vpn);
-			if(err){
-				return err;
-			}
-			//bzero((void*)PADDR_TO_KVADDR(as->page_table->pas), PAGE_SIZE);
+/* Pages of mincore output gathered per copyout */
+#define MINCORE_CHUNK 128
 
+int sys_mincore(vaddr_t addr, size_t len, userptr_t vec, int *retval){
+	struct addrspace *as = curproc->p_addrspace;
+	unsigned char kvec[MINCORE_CHUNK];
+	vaddr_t end, va, chunkend;
+	int err;
+
+	*retval = -1;
+	err = check_mrange(as, addr, len, &end);
+	if(err){
+		return err;
+	}
+	for(va = addr; va < end; va = chunkend){
+		chunkend = end - va > MINCORE_CHUNK * PAGE_SIZE ?
+			va + MINCORE_CHUNK * PAGE_SIZE : end;
+		vm_mincore(as, va, chunkend, kvec);
+		err = copyout(kvec, vec, (chunkend - va) / PAGE_SIZE);
+		if(err){
+			return err;
 		}
-		*retval = heap_e;
-		curproc->p_addrspace->heap_region->as_vend += amount;
+		vec += (chunkend - va) / PAGE_SIZE;
+	}
+	*retval = 0;
+	return 0;
+}
 
+int sys_mlock(vaddr_t addr, size_t len, int *retval){
+	struct addrspace *as = curproc->p_addrspace;
+	vaddr_t end;
+	int err;
+
+	*retval = -1;
+	err = check_mrange(as, addr, len, &end);
+	if(err){
+		return err;
+	}
+	/* On failure this undoes its own wiring, and only that */
+	err = vm_populate(as, addr, end, true);
+	if(err){
+		return err;
 	}
+	*retval = 0;
 	return 0;
 }
 
-*/
+int sys_munlock(vaddr_t addr, size_t len, int *retval){
+	struct addrspace *as = curproc->p_addrspace;
+	vaddr_t end;
+	int err;
+
+	*retval = -1;
+	err = check_mrange(as, addr, len, &end);
+	if(err){
+		return err;
+	}
+	vm_unwire(as, addr, end);
+	*retval = 0;
+	return 0;
+}
+
+/*
+ * getrusage(who, usage). Only the paging fields are kept: ru_maxrss,
+ * ru_minflt, ru_majflt and ru_nswap, which counts pages evicted rather
+ * than whole-process swaps. The rest read as zero. RUSAGE_CHILDREN
+ * would need counters folded in at waitpid, which we don't do.
+ */
+int sys_getrusage(int who, userptr_t usage, int *retval){
+	struct addrspace *as = curproc->p_addrspace;
+	struct vm_usage vu;
+	struct rusage ru;
+
+	*retval = -1;
+	if(who != RUSAGE_SELF){
+		return EINVAL;
+	}
+
+	bzero(&ru, sizeof(ru));
+	if(as != NULL){
+		vm_getusage(as, &vu);
+		ru.ru_maxrss = vu.vu_maxresident * (PAGE_SIZE / 1024);
+		ru.ru_minflt = vu.vu_minflt + vu.vu_cowbreaks;
+		ru.ru_majflt = vu.vu_majflt;
+		ru.ru_nswap = vu.vu_evicted;
+	}
+	*retval = 0;
+	return copyout(&ru, usage, sizeof(ru));
+}
+#else
+int sys_madvise(vaddr_t addr, size_t len, int advice, int *retval){
+	(void)addr;
+	(void)len;
+	(void)advice;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_mincore(vaddr_t addr, size_t len, userptr_t vec, int *retval){
+	(void)addr;
+	(void)len;
+	(void)vec;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_mlock(vaddr_t addr, size_t len, int *retval){
+	(void)addr;
+	(void)len;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_munlock(vaddr_t addr, size_t len, int *retval){
+	(void)addr;
+	(void)len;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_getrusage(int who, userptr_t usage, int *retval){
+	(void)who;
+	(void)usage;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_sbrk(intptr_t amount, int *retval){
+	(void)amount;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags,
+	     const_userptr_t stackargs, int *retval){
+	(void)addr;
+	(void)len;
+	(void)prot;
+	(void)flags;
+	(void)stackargs;
+	*retval = -1;
+	return ENOSYS;
+}
+
+int sys_munmap(vaddr_t addr, size_t len, int *retval){
+	(void)addr;
+	(void)len;
+	*retval = -1;
+	return ENOSYS;
+}
+#endif /* OPT_DUMBVM */
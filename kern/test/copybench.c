@@ -0,0 +1,201 @@
+/*
+ * Throughput of copyin/copyout and copyinstr/copyoutstr.
+ *
+ * Builds a scratch address space for the menu thread, maps a buffer in
+ * it, and times repeated copies across the user/kernel boundary, with
+ * plain memcpy between kernel buffers for comparison. Uses only the
+ * standard as_* calls, so it runs under dumbvm too.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <test.h>
+
+#define CB_VADDR	0x10000000	/* where the scratch buffer goes */
+#define CB_BUFSIZE	(64 * 1024)
+#define CB_STRLEN	1024		/* same as PATH_MAX, NUL included */
+#define CB_DEFAULTMB	16
+
+/* Bytes per nanosecond, times 1000, is MB/s; print it to 2 places */
+static
+void
+cb_report(const char *what, uint64_t bytes, const struct timespec *ts)
+{
+	uint64_t ns, rate;
+
+	ns = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	rate = bytes * 100000 / ns;
+	kprintf("%-24s %8llu.%02llu MB/s\n", what,
+		(unsigned long long)(rate / 100),
+		(unsigned long long)(rate % 100));
+}
+
+/*
+ * Time NROUNDS calls of one copy. KIND: 0 copyin, 1 copyout,
+ * 2 copyinstr, 3 copyoutstr, 4 memcpy. OFFSET misaligns the user side.
+ */
+static
+int
+cb_run(const char *what, int kind, char *kbuf, char *kbuf2,
+       unsigned offset, size_t len, unsigned nrounds)
+{
+	struct timespec before, after;
+	userptr_t ubuf = (userptr_t)(CB_VADDR + offset);
+	size_t got;
+	unsigned i;
+	int result = 0;
+
+	gettime(&before);
+	for (i=0; i<nrounds && result == 0; i++) {
+		switch (kind) {
+		    case 0:
+			result = copyin(ubuf, kbuf, len);
+			break;
+		    case 1:
+			result = copyout(kbuf, ubuf, len);
+			break;
+		    case 2:
+			result = copyinstr(ubuf, kbuf, len, &got);
+			break;
+		    case 3:
+			result = copyoutstr(kbuf, ubuf, len, &got);
+			break;
+		    default:
+			memcpy(kbuf2, kbuf + offset, len);
+			break;
+		}
+	}
+	gettime(&after);
+	if (result) {
+		kprintf("copybench: %s: %s\n", what, strerror(result));
+		return result;
+	}
+	if ((kind == 2 || kind == 3) && got != len) {
+		kprintf("copybench: %s: copied %zu bytes, not %zu\n",
+			what, got, len);
+		return EINVAL;
+	}
+
+	timespec_sub(&after, &before, &after);
+	cb_report(what, (uint64_t)nrounds * len, &after);
+	return 0;
+}
+
+int
+copybench(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	char *kbuf, *kbuf2;
+	unsigned mb, blockrounds, strrounds;
+	int result;
+
+	mb = CB_DEFAULTMB;
+	if (nargs == 2) {
+		mb = atoi(args[1]);
+	}
+	else if (nargs > 2) {
+		kprintf("Usage: cb [megabytes]\n");
+		return EINVAL;
+	}
+	if (mb == 0) {
+		mb = 1;
+	}
+	blockrounds = mb * (1024 * 1024 / CB_BUFSIZE);
+	strrounds = mb * (1024 * 1024 / CB_STRLEN);
+
+	kbuf = kmalloc(CB_BUFSIZE);
+	kbuf2 = kmalloc(CB_BUFSIZE);
+	as = as_create();
+	if (kbuf == NULL || kbuf2 == NULL || as == NULL) {
+		if (as != NULL) {
+			as_destroy(as);
+		}
+		result = ENOMEM;
+		goto out;
+	}
+
+	result = as_define_region(as, CB_VADDR, CB_BUFSIZE, 1, 1, 0);
+	if (result == 0) {
+		result = as_prepare_load(as);
+	}
+	if (result == 0) {
+		result = as_complete_load(as);
+	}
+	if (result) {
+		as_destroy(as);
+		goto out;
+	}
+
+	oldas = proc_setas(as);
+	as_activate();
+
+	/* Fault the buffer in so we time copying, not paging */
+	memset(kbuf, 'x', CB_BUFSIZE);
+	result = copyout(kbuf, (userptr_t)CB_VADDR, CB_BUFSIZE);
+
+	kprintf("copybench: %u MB per block test, %u strings of %u bytes\n",
+		mb, strrounds, CB_STRLEN);
+	if (result == 0) {
+		result = cb_run("memcpy (kernel)", 4, kbuf, kbuf2, 0,
+				CB_BUFSIZE, blockrounds);
+	}
+	if (result == 0) {
+		result = cb_run("copyin aligned", 0, kbuf, kbuf2, 0,
+				CB_BUFSIZE, blockrounds);
+	}
+	if (result == 0) {
+		result = cb_run("copyout aligned", 1, kbuf, kbuf2, 0,
+				CB_BUFSIZE, blockrounds);
+	}
+	if (result == 0) {
+		result = cb_run("copyin misaligned", 0, kbuf, kbuf2, 1,
+				CB_BUFSIZE - 1, blockrounds);
+	}
+	if (result == 0) {
+		result = cb_run("copyout misaligned", 1, kbuf, kbuf2, 1,
+				CB_BUFSIZE - 1, blockrounds);
+	}
+
+	/* A CB_STRLEN-byte string, null included, for the string tests */
+	kbuf[CB_STRLEN - 1] = 0;
+	if (result == 0) {
+		result = copyout(kbuf, (userptr_t)CB_VADDR, CB_STRLEN);
+	}
+	if (result == 0) {
+		result = copyout(kbuf, (userptr_t)CB_VADDR + 1, CB_STRLEN);
+	}
+	if (result == 0) {
+		result = cb_run("copyinstr aligned", 2, kbuf, kbuf2, 0,
+				CB_STRLEN, strrounds);
+	}
+	if (result == 0) {
+		result = cb_run("copyinstr misaligned", 2, kbuf2, kbuf2, 1,
+				CB_STRLEN, strrounds);
+	}
+	if (result == 0) {
+		result = cb_run("copyoutstr aligned", 3, kbuf, kbuf2, 0,
+				CB_STRLEN, strrounds);
+	}
+	if (result == 0) {
+		result = cb_run("copyoutstr misaligned", 3, kbuf, kbuf2, 1,
+				CB_STRLEN, strrounds);
+	}
+
+	proc_setas(oldas);
+	as_deactivate();
+	as_destroy(as);
+
+ out:
+	kfree(kbuf2);
+	kfree(kbuf);
+	kprintf("copybench: %s\n", result ? "FAILED" : "done");
+	return result;
+}
@@ -33,41 +33,70 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <kmem_cache.h>
 #include <synch.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+/*
+ * Semaphores, locks and CVs come from object caches that keep them
+ * with their wait channel (and for CVs, internal lock) already made
+ * and their spinlock initialized. The create functions only fill in
+ * the name and the starting state.
+ */
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	sem->sem_wchan = wchan_create("sem");
+	if (sem->sem_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_destroy(sem->sem_wchan);
+}
+
+static struct kmem_cache sem_cache =
+	KMEM_CACHE_INITIALIZER("semaphore", sizeof(struct semaphore), 16,
+			       sem_ctor, sem_dtor);
+
 struct semaphore *
 sem_create(const char *name, unsigned initial_count)
 {
 	struct semaphore *sem;
 
-	sem = kmalloc(sizeof(*sem));
+	sem = kmem_cache_alloc(&sem_cache);
 	if (sem == NULL) {
 		return NULL;
 	}
 
 	sem->sem_name = kstrdup(name);
 	if (sem->sem_name == NULL) {
-		kfree(sem);
-		return NULL;
-	}
-
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
+		kmem_cache_free(&sem_cache, sem);
 		return NULL;
 	}
+	wchan_setname(sem->sem_wchan, sem->sem_name);
 
-	spinlock_init(&sem->sem_lock);
 	sem->sem_count = initial_count;
 
 	return sem;
@@ -77,11 +106,13 @@ void
 sem_destroy(struct semaphore *sem){
 	KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+	/* Nobody may still be waiting on it */
+	spinlock_acquire(&sem->sem_lock);
+	KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+	spinlock_release(&sem->sem_lock);
+	wchan_setname(sem->sem_wchan, "sem");
 	kfree(sem->sem_name);
-	kfree(sem);
+	kmem_cache_free(&sem_cache, sem);
 }
 //Semaphore's shared resource is the count, so must use a spinlock to protect that shared resource
 void
@@ -137,30 +168,51 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_chan = wchan_create("lock");
+	if (lock->lk_chan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	lock->lk_thread = NULL;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_chan);
+}
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock), 32,
+			       lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(*lock));
+	lock = kmem_cache_alloc(&lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
+		kmem_cache_free(&lock_cache, lock);
 		return NULL;
 	}
-
-	lock->lk_chan = wchan_create(lock->lk_name);
-	if(lock->lk_chan == NULL){
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_lock);
-	lock->lk_thread = NULL;
+	wchan_setname(lock->lk_chan, lock->lk_name);
 	HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
 
 	// add stuff here as needed
@@ -174,10 +226,14 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 	KASSERT(lock->lk_thread == NULL);
 	KASSERT(!lock_do_i_hold(lock));
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_chan);
+
+	/* Nobody may still be waiting on it */
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(wchan_isempty(lock->lk_chan, &lock->lk_lock));
+	spinlock_release(&lock->lk_lock);
+	wchan_setname(lock->lk_chan, "lock");
 	kfree(lock->lk_name);
-	kfree(lock);
+	kmem_cache_free(&lock_cache, lock);
 }
 
 //lock's thread pointer is a shared resource and must be protected by the spinlock
@@ -228,33 +284,54 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	/* Only the lock's spinlock is used, to guard the wchan */
+	cv->cv_lock = lock_create("cv");
+	if (cv->cv_lock == NULL) {
+		return ENOMEM;
+	}
+	cv->cv_wchan = wchan_create("cv");
+	if (cv->cv_wchan == NULL) {
+		lock_destroy(cv->cv_lock);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	wchan_destroy(cv->cv_wchan);
+	lock_destroy(cv->cv_lock);
+}
+
+static struct kmem_cache cv_cache =
+	KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv), 32, cv_ctor, cv_dtor);
+
 struct cv *
 cv_create(const char *name)
 {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(*cv));
+	cv = kmem_cache_alloc(&cv_cache);
 	if (cv == NULL) {
 		return NULL;
 	}
 
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name==NULL) {
-		kfree(cv);
+		kmem_cache_free(&cv_cache, cv);
 		return NULL;
 	}
-	
-	cv->cv_lock = lock_create(cv->cv_name);
-	if(cv->cv_lock == NULL){
-                kfree(cv->cv_name);
-                kfree(cv);
-        }
-
-	cv->cv_wchan = wchan_create(cv->cv_name);
-	if(cv->cv_wchan == NULL){
-         	kfree(cv->cv_name);
-		kfree(cv);
-	}
+	wchan_setname(cv->cv_wchan, cv->cv_name);
 	return cv;
 }
 
@@ -263,10 +340,14 @@ cv_destroy(struct cv *cv)
 {
 	KASSERT(cv != NULL);
 	KASSERT(cv->cv_lock->lk_thread == NULL);
-	lock_destroy(cv->cv_lock);
-	wchan_destroy(cv->cv_wchan);
+
+	/* Nobody may still be waiting on it */
+	spinlock_acquire(&cv->cv_lock->lk_lock);
+	KASSERT(wchan_isempty(cv->cv_wchan, &cv->cv_lock->lk_lock));
+	spinlock_release(&cv->cv_lock->lk_lock);
+	wchan_setname(cv->cv_wchan, "cv");
 	kfree(cv->cv_name);
-	kfree(cv);
+	kmem_cache_free(&cv_cache, cv);
 }
 
 void
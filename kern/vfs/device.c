@@ -245,7 +245,7 @@ int
 dev_mmap(struct vnode *v  /* add stuff as needed */)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
@@ -28,52 +28,215 @@
  * SUCH DAMAGE.
  */
 
+#define ASINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <current.h>
 #include <pagetable.h>
 #include <machine/tlb.h>
 #include <spl.h>
+#include <vnode.h>
+#include <kmem_cache.h>
+
+/*
+ * The stack starts out one page long and grows down on demand, up to
+ * as_stackmax bytes (vm_stack_maxpages when the address space was
+ * made). Space for all of it plus a guard page underneath is kept
+ * clear of the heap and mappings; a fault in the guard page is a stack
+ * overflow.
+ */
+#define STACK_INITPAGES 1
+unsigned vm_stack_maxpages = 2048;
 
-/********* Region_table functions ********/
+static struct kmem_cache region_cache =
+	KMEM_CACHE_INITIALIZER("region", sizeof(struct region), 32,
+			       NULL, NULL);
+static struct kmem_cache as_cache =
+	KMEM_CACHE_INITIALIZER("addrspace", sizeof(struct addrspace), 16,
+			       NULL, NULL);
 
-int push_region(struct region **region_table, vaddr_t vaddr, vaddr_t vaddr_end, int npages){
-	/* Need to do a check on the head to see if NULL */
-	struct region *new_region;
-	new_region = kmalloc(sizeof(*new_region));
+/********* Region functions ********/
 
-	if(new_region == NULL){
-		kprintf("No mem for new region");
-		return ENOSYS;
+static
+struct region *
+region_create(vaddr_t vbase, vaddr_t vend, pte_t permissions, unsigned type){
+	struct region *region;
+
+	region = kmem_cache_alloc(&region_cache);
+	if(region == NULL){
+		return NULL;
 	}
-	
-	new_region->as_vbase = vaddr;
-	new_region->as_vend = vaddr_end;
-	new_region->region_pages = npages;
-		
-	new_region->next = *region_table;
-	*region_table = new_region;
+	region->as_vbase = vbase;
+	region->as_vend = vend;
+	region->as_pbase = 0;
+	region->region_pages = (vend - vbase) / PAGE_SIZE;
+	region->permissions = permissions;
+	region->region_type = type;
+	region->region_advice = MADV_NORMAL;
+	region->vnode = NULL;
+	region->file_offset = 0;
+	region->file_vaddr = 0;
+	region->filesize = 0;
+	region->ra_next = vbase;
+	region->ra_window = 0;
+	return region;
+}
+
+/* Regions own no frames; those are released with the page table */
+static
+void
+region_destroy(struct region *region){
+	if(region->vnode != NULL){
+		VOP_DECREF(region->vnode);
+	}
+	kmem_cache_free(&region_cache, region);
+}
 
+/* Share SRC's file backing with DST */
+static
+void
+region_copy_backing(struct region *dst, const struct region *src){
+	if(src->vnode != NULL){
+		VOP_INCREF(src->vnode);
+	}
+	dst->vnode = src->vnode;
+	dst->file_offset = src->file_offset;
+	dst->file_vaddr = src->file_vaddr;
+	dst->filesize = src->filesize;
+}
+
+/* Index of the first region that starts above VA */
+static
+unsigned
+region_upper(struct addrspace *as, vaddr_t va){
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = regionarray_num(&as->as_regions);
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(regionarray_get(&as->as_regions, mid)->as_vbase <= va){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Index of REGION in the array; it has to be there */
+static
+unsigned
+region_index(struct addrspace *as, struct region *region){
+	unsigned i;
+
+	for(i = region_upper(as, region->as_vbase); i-- > 0; ){
+		if(regionarray_get(&as->as_regions, i) == region){
+			return i;
+		}
+	}
+	panic("region_index: region 0x%x not in address space\n",
+	      region->as_vbase);
+}
+
+/* Put REGION in its place in the sorted array */
+static
+int
+region_insert(struct addrspace *as, struct region *region){
+	unsigned i, n;
+	int err;
+
+	n = regionarray_num(&as->as_regions);
+	i = region_upper(as, region->as_vbase);
+	err = regionarray_setsize(&as->as_regions, n + 1);
+	if(err){
+		return err;
+	}
+	for(; n > i; n--){
+		regionarray_set(&as->as_regions, n,
+				regionarray_get(&as->as_regions, n - 1));
+	}
+	regionarray_set(&as->as_regions, i, region);
 	return 0;
 }
 
-struct region * pop_region(struct region **head){
-	struct region *temp = NULL;
-	if(*head == NULL){
-		kprintf("Region_table is NULL");	
+struct region *
+as_region_lookup(struct addrspace *as, vaddr_t va){
+	struct region *region;
+	unsigned i;
+
+	i = region_upper(as, va);
+	if(i == 0){
+		return NULL;
+	}
+	region = regionarray_get(&as->as_regions, i - 1);
+	if(va >= region->as_vend){
+		return NULL;
+	}
+	return region;
+}
+
+/*
+ * End of the heap as far as other regions are concerned. An empty
+ * heap still holds on to the page at its base, so that nothing else
+ * can start at the same address.
+ */
+static
+vaddr_t
+heap_top(struct addrspace *as){
+	vaddr_t top = ROUNDUP(as->heap_region->as_vend, PAGE_SIZE);
+
+	return top > as->heap_region->as_vbase ? top : as->heap_region->as_vbase + PAGE_SIZE;
+}
+
+/* The guard page under the lowest address the stack may grow to */
+static
+vaddr_t
+stack_floor(struct addrspace *as){
+	vaddr_t floor = USERSTACK - as->as_stackmax;
+
+	if(floor > as->stack_region->as_vbase){
+		floor = as->stack_region->as_vbase;
 	}
-	temp = (*head)->next;
-	free_kpages((*head)->as_vbase);
-	free_upages((*head)->as_pbase);
-	kfree(*head);
+	return floor - PAGE_SIZE;
+}
 
-	*head = temp;
-	return *head;
+/* Space REGION takes up, counting room the heap and stack keep */
+static
+void
+region_extent(struct addrspace *as, struct region *region,
+	      vaddr_t *start, vaddr_t *end){
+	*start = region == as->stack_region ? stack_floor(as) : region->as_vbase;
+	*end = region == as->heap_region ? heap_top(as) : region->as_vend;
+}
+
+/* True if [START, END) touches anything other than mmap regions */
+static
+bool
+as_range_reserved(struct addrspace *as, vaddr_t start, vaddr_t end){
+	struct region *region;
+	unsigned i, n;
+	vaddr_t rstart, rend;
+
+	n = regionarray_num(&as->as_regions);
+	for(i = 0; i < n; i++){
+		region = regionarray_get(&as->as_regions, i);
+		region_extent(as, region, &rstart, &rend);
+		if(region->region_type != REGION_MMAP &&
+		   rstart < end && start < rend){
+			return true;
+		}
+	}
+	return false;
 }
-/********* Region_table functions ********/
+/********* Region functions ********/
 
 
 /*
@@ -82,70 +245,71 @@ struct region * pop_region(struct region **head){
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/* An address space with no regions yet */
+static
 struct addrspace *
-as_create(void)
+as_alloc(void)
 {
 	struct addrspace *as;
 
-	as = kmalloc(sizeof(struct addrspace));
+	as = kmem_cache_alloc(&as_cache);
 	if (as == NULL) {
-		kprintf("Code or text region failed, ran out mem");
 		return NULL;
 	}
+	regionarray_init(&as->as_regions);
+	as->stack_region = NULL;
+	as->heap_region = NULL;
+	as->as_stackmax = vm_stack_maxpages * PAGE_SIZE;
+	if(as->as_stackmax > USERSTACK / 2){
+		as->as_stackmax = USERSTACK / 2;
+	}
 
-	/*
-	 * Initialize as needed.
-	 */
-
-	as->region_table = kmalloc(sizeof(struct region));
-	if (as->region_table == NULL) {
-		kprintf("Code or text region failed, ran out mem");
+	/* Pages are entered on demand in vm_fault */
+	as->page_table = pagetable_create();
+	if (as->page_table == NULL) {
+		as_destroy(as);
 		return NULL;
 	}
+	as->as_asid = vm_newasid();
+	as->as_cpumask = 0;
+	bzero(&as->as_usage, sizeof(as->as_usage));
+	return as;
+}
 
-	as->region_table->as_vbase = 0;
-	as->region_table->as_vend = 0;
-	as->region_table->as_pbase = 0;
-	as->region_table->region_pages = 0;
-	as->region_table->next = NULL;
-	
-	/* Should we allocate space for stack & heap in here?
-	 * or in as_define_stack (stack) and as_prepare_load (heap) it?
-	 */
-	as->stack_region = kmalloc(sizeof(struct region));
-	if (as->stack_region== NULL) {
-		kprintf("Stack region failed, ran out mem");
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = as_alloc();
+	if (as == NULL) {
 		return NULL;
 	}
 
-	as->stack_region->as_vbase = USERSTACK- (1024 *PAGE_SIZE);
-	as->stack_region->as_vend = USERSTACK;	
-	as->stack_region->as_pbase = 0;
-	as->stack_region->region_pages = 1024;
-	as->stack_region->next = NULL;
-
-	
-	as->heap_region = kmalloc(sizeof(struct region));
-	if (as->heap_region == NULL) {
-		kprintf("Heap region failed, ran out mem");
+	/*
+	 * The heap starts out empty; as_define_region moves it above
+	 * the last segment.
+	 */
+	as->stack_region = region_create(USERSTACK - STACK_INITPAGES * PAGE_SIZE,
+					 USERSTACK, PTE_READ | PTE_WRITE,
+					 REGION_STACK);
+	if (as->stack_region == NULL || region_insert(as, as->stack_region)) {
+		if (as->stack_region != NULL) {
+			region_destroy(as->stack_region);
+			as->stack_region = NULL;
+		}
+		as_destroy(as);
 		return NULL;
 	}
-	
-	as->heap_region->as_vbase = 0;
-	as->heap_region->as_vend = 0;
-	as->heap_region->as_pbase = 0;
-	as->heap_region->region_pages = 0;
-	as->heap_region->next = NULL;
-
-	/* Prob in vm_fault*/
-	as->page_table = kmalloc(sizeof(struct page_entry));
-	if (as->page_table == NULL) {
+	as->heap_region = region_create(0, 0, PTE_READ | PTE_WRITE, REGION_HEAP);
+	if (as->heap_region == NULL || region_insert(as, as->heap_region)) {
+		if (as->heap_region != NULL) {
+			region_destroy(as->heap_region);
+			as->heap_region = NULL;
+		}
+		as_destroy(as);
 		return NULL;
 	}
-	
-	as->page_table->vpn = 0;
-	as->page_table->pas = 0;
-	as->page_table->next = NULL;
 
 	return as;
 }
@@ -154,66 +318,57 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
-	struct region *temp;
-	struct page_entry *temp_pte;
-
+	struct region *oldr, *newr;
+	unsigned i, n;
 	int err = 0;
-	newas = as_create();
+
+	newas = as_alloc();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
-	/*
-	 *  Start copying old addrspace into newas addrspace.
-	 */
-
-	//Copy region_table
-	temp = old->region_table;
-	while(temp != NULL){
-		err = push_region(&(newas->region_table),temp->as_vbase,temp->as_vend,temp->region_pages);
-		if(err){
-			return err;
-		}
+	newas->as_stackmax = old->as_stackmax;
 
-	
-		temp = temp->next;
+	/* Regions come out in order, so they can just be appended */
+	n = regionarray_num(&old->as_regions);
+	err = regionarray_preallocate(&newas->as_regions, n);
+	if(err){
+		as_destroy(newas);
+		return err;
 	}
-	
-	//Copy heap region
-	temp = old->heap_region;
-	while(temp != NULL){
-		err = push_region(&(newas->heap_region),temp->as_vbase,temp->as_vend,temp->region_pages);
-		if(err){
-			return err;
+	for(i = 0; i < n; i++){
+		oldr = regionarray_get(&old->as_regions, i);
+		newr = region_create(oldr->as_vbase, oldr->as_vend,
+				     oldr->permissions, oldr->region_type);
+		if(newr == NULL){
+			as_destroy(newas);
+			return ENOMEM;
 		}
-		temp = temp->next;
-	}
-
-	//Copy stack region
-	temp = old->stack_region;
-	while(temp != NULL){
-		err = push_region(&(newas->stack_region),temp->as_vbase,temp->as_vend,temp->region_pages);
-		if(err){
-			return err;
+		region_copy_backing(newr, oldr);
+		newr->region_advice = oldr->region_advice;
+		/* Can't fail after the preallocate */
+		regionarray_add(&newas->as_regions, newr, NULL);
+		if(oldr == old->stack_region){
+			newas->stack_region = newr;
+		}
+		else if(oldr == old->heap_region){
+			newas->heap_region = newr;
 		}
-
-		
-		temp = temp->next;
-	
 	}
 
-	//Copy page_table
-	temp_pte = old->page_table;	
-	while(temp_pte != NULL){
-		err = push_pte(&(newas->page_table),temp_pte->vpn);
-		if(err){
-			return err;
-		}
-		//bzero((void*)PADDR_TO_KVADDR(newas->page_table->pas),PAGE_SIZE);
-	
-		memmove((void*)PADDR_TO_KVADDR(newas->page_table->pas), (const void*)PADDR_TO_KVADDR(temp_pte->pas),PAGE_SIZE);
-		temp_pte = temp_pte->next;
-	
+	//Share page_table copy-on-write
+	err = pagetable_copy(old->page_table, newas->page_table,
+			     &newas->as_usage);
+	/*
+	 * Pages we just marked COW may still be writable in our TLB
+	 * (fork runs in the parent), or in that of any CPU we ran on
+	 * before. Retire the ASID even on failure, as some may already
+	 * have been marked.
+	 */
+	vm_tlbretire(old, 0, USERSPACETOP);
+	if(err){
+		as_destroy(newas);
+		return err;
 	}
 	*ret = newas;
 	
@@ -223,52 +378,39 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
+	unsigned i, n;
+
 	/*
-	 * Clean up as needed.
+	 * A context switch would run vm_tlbactivate on it, which writes
+	 * as_cpumask; take it out of curproc first.
 	 */
-	
-	while(as->region_table != NULL){
-		as->region_table = pop_region(&as->region_table);
-	}
-	
-	kfree(as->region_table); //head
+	KASSERT(curproc == NULL || curproc->p_addrspace != as);
 
-	while(as->stack_region != NULL){
-		as->stack_region = pop_region(&as->stack_region);	
+	n = regionarray_num(&as->as_regions);
+	for(i = 0; i < n; i++){
+		region_destroy(regionarray_get(&as->as_regions, i));
 	}
-	
-	kfree(as->stack_region); //head
-	
-	while(as->heap_region != NULL){
-		as->heap_region = pop_region(&as->heap_region);
+	regionarray_setsize(&as->as_regions, 0);
+	regionarray_cleanup(&as->as_regions);
+
+	if(as->page_table != NULL){
+		pagetable_destroy(as->page_table);
 	}
-		
-	kfree(as->heap_region);
-	
-	struct page_entry * head = destroy_pagetable(as->page_table);
-	kfree(head);
-	kfree(as);
+	kmem_cache_free(&as_cache, as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
 	if (as == NULL) {
+		/* Kernel threads leave the last user TLB contents alone */
 		return;
 	}
 
-	/**** Disable interrupts on this CPU while frobbing the TLB. ****/
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	vm_tlbactivate(as);
 }
 
 void
@@ -286,77 +428,293 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. They are
+ * recorded in the region and copied into each page's PTE.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
-	
-	/* Taken from DUMBVM */
-	size_t npages = 0;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
+	struct region *region, *heap;
+	vaddr_t rstart, rend;
+	unsigned i, n;
+	int err;
 
-	
 	/* Align the region. First, the base... */
 	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
-/*	vaddr &= PAGE_FRAME;*/
+	vaddr &= PAGE_FRAME;
 
 	/* ...and now the length. */
 	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	npages = memsize / PAGE_SIZE;
-	
-	/* Put it altogether now */
-	
-	vaddr_t vaddr_end = vaddr + (npages*PAGE_SIZE);
-	if(as->region_table->as_vbase== 0){
-		as->region_table->as_vbase = vaddr;
-		as->region_table->as_vend = vaddr_end;
-		as->region_table->region_pages = npages;
-	}else{
-		int err = 0;
-	err = push_region(&(as->region_table), vaddr, vaddr_end, npages);
+	/* Segments must lie entirely in user space */
+	if(vaddr + memsize > USERSPACETOP || vaddr + memsize < vaddr){
+		return EFAULT;
+	}
+
+	/* Segments may not overlap each other or the stack's room */
+	heap = as->heap_region;
+	n = regionarray_num(&as->as_regions);
+	for(i = 0; i < n; i++){
+		region = regionarray_get(&as->as_regions, i);
+		region_extent(as, region, &rstart, &rend);
+		if(region != heap && rstart < vaddr + memsize && vaddr < rend){
+			return EINVAL;
+		}
+	}
+
+	region = region_create(vaddr, vaddr + memsize,
+			       pte_permissions(readable, writeable, executable),
+			       REGION_SEGMENT);
+	if(region == NULL){
+		return ENOMEM;
+	}
+
+	/* The (still empty) heap moves up to follow the highest segment */
+	regionarray_remove(&as->as_regions, region_index(as, heap));
+	err = region_insert(as, region);
+	if(err){
+		region_destroy(region);
+	}
+	else if(heap->as_vbase < region->as_vend){
+		KASSERT(heap->as_vbase == heap->as_vend);
+		heap->as_vbase = heap->as_vend = region->as_vend;
+		heap->ra_next = heap->as_vbase;
+	}
+	/* Can't fail; the array had room for the heap a moment ago */
+	if(region_insert(as, heap)){
+		panic("as_define_region: lost the heap\n");
+	}
+	return err;
+}
+
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+		  off_t offset, size_t filesize)
+{
+	struct region *region;
+
+	region = as_region_lookup(as, vaddr);
+	if(region == NULL){
+		return EFAULT;
+	}
+	KASSERT(region->vnode == NULL);
+	if(vaddr + filesize > region->as_vend){
+		return ENOEXEC;
+	}
+
+	VOP_INCREF(v);
+	region->vnode = v;
+	region->file_offset = offset;
+	region->file_vaddr = vaddr;
+	region->filesize = filesize;
+	return 0;
+}
+
+vaddr_t
+as_heap_limit(struct addrspace *as){
+	struct region *next;
+	unsigned i;
+
+	/* The stack at least always comes after the heap */
+	i = region_index(as, as->heap_region);
+	next = regionarray_get(&as->as_regions, i + 1);
+	return next == as->stack_region ? stack_floor(as) : next->as_vbase;
+}
+
+bool
+as_range_mapped(struct addrspace *as, vaddr_t start, vaddr_t end){
+	struct region *region;
+	vaddr_t va;
+
+	for(va = start & PAGE_FRAME; va < end; va = ROUNDUP(region->as_vend, PAGE_SIZE)){
+		region = as_region_lookup(as, va);
+		if(region == NULL){
+			return false;
+		}
+	}
+	return true;
+}
+
+void
+as_advise(struct addrspace *as, vaddr_t start, vaddr_t end, unsigned advice){
+	struct region *region;
+	unsigned i;
+
+	/* Advice is kept per region, so it spreads to the whole region */
+	i = region_upper(as, start);
+	if(i > 0){
+		i--;
+	}
+	for(; i < regionarray_num(&as->as_regions); i++){
+		region = regionarray_get(&as->as_regions, i);
+		if(region->as_vbase >= end){
+			break;
+		}
+		if(region->as_vend > start){
+			region->region_advice = advice;
+			region->ra_window = 0;
+		}
+	}
+}
+
+int
+as_grow_stack(struct addrspace *as, vaddr_t va){
+	struct region *stack = as->stack_region;
+	vaddr_t floor = stack_floor(as);
+
+	if(va >= stack->as_vbase || va < floor){
+		return EFAULT;
+	}
+	if(va < floor + PAGE_SIZE){
+		/* Guard page: stack overflow */
+		return EFAULT;
+	}
+	/* Nothing else lives in the stack's room, so order is kept */
+	stack->as_vbase = va & PAGE_FRAME;
+	stack->region_pages = (stack->as_vend - stack->as_vbase) / PAGE_SIZE;
+	return 0;
+}
+
+int
+as_map(struct addrspace *as, vaddr_t *addr, size_t len, pte_t perms,
+       struct vnode *v, off_t offset, size_t filesize, bool fixed)
+{
+	struct region *region;
+	vaddr_t start, top, bottom;
+	unsigned i;
+	int err;
+
+	KASSERT(len > 0 && len % PAGE_SIZE == 0);
+	KASSERT(filesize <= len);
+
+	if(fixed){
+		start = *addr;
+		if(start % PAGE_SIZE != 0 || start + len < start ||
+		   start + len > USERSPACETOP){
+			return EINVAL;
+		}
+		/* Only other mappings may be replaced */
+		if(as_range_reserved(as, start, start + len)){
+			return EINVAL;
+		}
+		err = as_unmap(as, start, start + len);
 		if(err){
 			return err;
 		}
 	}
+	else{
+		/*
+		 * Top-down first fit in the gaps between the stack's
+		 * room and the heap, which hold nothing but mappings.
+		 */
+		top = stack_floor(as);
+		i = region_index(as, as->stack_region);
+		for(;;){
+			KASSERT(i > 0);
+			region = regionarray_get(&as->as_regions, --i);
+			bottom = region == as->heap_region ?
+				heap_top(as) : region->as_vend;
+			if(top >= bottom && top - bottom >= len){
+				break;
+			}
+			if(region == as->heap_region){
+				return ENOMEM;
+			}
+			top = region->as_vbase;
+		}
+		start = top - len;
+	}
+
+	region = region_create(start, start + len, perms, REGION_MMAP);
+	if(region == NULL){
+		return ENOMEM;
+	}
+	if(v != NULL){
+		VOP_INCREF(v);
+		region->vnode = v;
+		region->file_offset = offset;
+		region->file_vaddr = start;
+		region->filesize = filesize;
+	}
+	err = region_insert(as, region);
+	if(err){
+		region_destroy(region);
+		return err;
+	}
+	*addr = start;
+	return 0;
+}
+
+int
+as_unmap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct region *region, *top;
+	unsigned i;
+	int err;
+
+	KASSERT(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
+
+	if(as_range_reserved(as, start, end)){
+		return EINVAL;
+	}
 
-	if(as->heap_region->as_vbase < as->region_table->as_vend){
-		as->heap_region->as_vbase = as->region_table->as_vend;
-		as->heap_region->as_vend = as->region_table->as_vend;
-		return 0;
+	i = region_upper(as, start);
+	if(i > 0){
+		i--;
+	}
+	while(i < regionarray_num(&as->as_regions)){
+		region = regionarray_get(&as->as_regions, i);
+		if(region->as_vbase >= end){
+			break;
+		}
+		if(region->as_vend <= start){
+			i++;
+			continue;
+		}
+		KASSERT(region->region_type == REGION_MMAP);
+		if(start <= region->as_vbase && region->as_vend <= end){
+			regionarray_remove(&as->as_regions, i);
+			region_destroy(region);
+			continue;
+		}
+		if(region->as_vbase < start && end < region->as_vend){
+			/* Punching a hole; the top part becomes its own region */
+			top = region_create(end, region->as_vend,
+					    region->permissions, REGION_MMAP);
+			if(top == NULL){
+				return ENOMEM;
+			}
+			region_copy_backing(top, region);
+			top->region_advice = region->region_advice;
+			err = region_insert(as, top);
+			if(err){
+				region_destroy(top);
+				return err;
+			}
+			region->as_vend = start;
+		}
+		else if(region->as_vbase < start){
+			region->as_vend = start;
+		}
+		else{
+			/* Nothing lies in [start, end), so order is kept */
+			region->as_vbase = end;
+		}
+		/* The file backing is by address, so it needs no adjusting */
+		region->region_pages = (region->as_vend - region->as_vbase) / PAGE_SIZE;
+		i++;
 	}
 
-	return ENOSYS;
+	vm_tlbretire(as, start, end);
+	pagetable_unmap_range(as->page_table, start, end, &as->as_usage);
+	return 0;
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 *
-	int npages = as->region_table->region_pages;
-	vaddr_t va = as->region_table->as_vbase;
-	//where the heap begins
-	as->heap_region->as_pbase = va + (PAGE_SIZE * npages);
-	
-	struct region *temp = as->region_table;
-	while(temp != NULL){
-		temp->as_pbase = get_ppages(temp->region_pages);
-		if(temp->as_pbase == 0){
-			return ENOMEM;
-		}
-		temp = temp->next;
-	}*/
+	/* Nothing to do; segments are paged in from the file on demand */
 	(void)as;
 	return 0;
 }
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <endian.h>
 #include <setjmp.h>
 #include <thread.h>
 #include <current.h>
@@ -142,12 +143,68 @@ copycheck(const_userptr_t userptr, size_t len, size_t *stoplen)
 	return 0;
 }
 
+/*
+ * Block copy for copyin and copyout. memcpy only goes a word at a time
+ * when the length is a multiple of the word size as well, which
+ * read() and write() buffers usually aren't. When the two pointers
+ * share their alignment we copy up to a word boundary by bytes, move
+ * the bulk eight words per iteration, and finish the tail by bytes.
+ * Otherwise there is nothing better than bytes without unaligned
+ * loads, so memcpy does it.
+ */
+static
+void
+copyblock(void *dest, const void *src, size_t len)
+{
+	char *d = dest;
+	const char *s = src;
+	uint32_t *dw;
+	const uint32_t *sw;
+
+	if ((((uintptr_t)d ^ (uintptr_t)s) & 3) != 0 || len < 16) {
+		memcpy(dest, src, len);
+		return;
+	}
+
+	while (((uintptr_t)s & 3) != 0) {
+		*d++ = *s++;
+		len--;
+	}
+
+	dw = (uint32_t *)d;
+	sw = (const uint32_t *)s;
+	while (len >= 32) {
+		dw[0] = sw[0];
+		dw[1] = sw[1];
+		dw[2] = sw[2];
+		dw[3] = sw[3];
+		dw[4] = sw[4];
+		dw[5] = sw[5];
+		dw[6] = sw[6];
+		dw[7] = sw[7];
+		dw += 8;
+		sw += 8;
+		len -= 32;
+	}
+	while (len >= 4) {
+		*dw++ = *sw++;
+		len -= 4;
+	}
+
+	d = (char *)dw;
+	s = (const char *)sw;
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
+	}
+}
+
 /*
  * copyin
  *
  * Copy a block of memory of length LEN from user-level address USERSRC
- * to kernel address DEST. We can use memcpy because it's protected by
- * the tm_badfaultfunc/copyfail logic.
+ * to kernel address DEST. We can use copyblock because it's protected
+ * by the tm_badfaultfunc/copyfail logic.
  */
 int
 copyin(const_userptr_t usersrc, void *dest, size_t len)
@@ -172,7 +229,7 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
 		return EFAULT;
 	}
 
-	memcpy(dest, (const void *)usersrc, len);
+	copyblock(dest, (const void *)usersrc, len);
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
 	return 0;
@@ -182,7 +239,7 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
  * copyout
  *
  * Copy a block of memory of length LEN from kernel address SRC to
- * user-level address USERDEST. We can use memcpy because it's
+ * user-level address USERDEST. We can use copyblock because it's
  * protected by the tm_badfaultfunc/copyfail logic.
  */
 int
@@ -208,12 +265,40 @@ copyout(const void *src, userptr_t userdest, size_t len)
 		return EFAULT;
 	}
 
-	memcpy((void *)userdest, src, len);
+	copyblock((void *)userdest, src, len);
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
 	return 0;
 }
 
+/*
+ * True if any byte of the word W is zero. Subtracting one from each
+ * byte borrows into the high bit only for bytes that were zero (or
+ * already had the high bit set, which the ~w rules out).
+ */
+#define HASZERO(w)	(((w) - 0x01010101U) & ~(w) & 0x80808080U)
+
+/*
+ * Store the four bytes of W to a possibly unaligned DEST in memory
+ * order, as if W had been stored there directly.
+ */
+static
+void
+storeword(char *dest, uint32_t w)
+{
+#if _BYTE_ORDER == _BIG_ENDIAN
+	dest[0] = w >> 24;
+	dest[1] = w >> 16;
+	dest[2] = w >> 8;
+	dest[3] = w;
+#else
+	dest[0] = w;
+	dest[1] = w >> 8;
+	dest[2] = w >> 16;
+	dest[3] = w >> 24;
+#endif
+}
+
 /*
  * Common string copying function that behaves the way that's desired
  * for copyinstr and copyoutstr.
@@ -235,15 +320,51 @@ int
 copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	size_t *gotlen)
 {
-	size_t i;
-
-	for (i=0; i<maxlen && i<stoplen; i++) {
+	size_t i, limit;
+	uint32_t w;
+
+	limit = maxlen < stoplen ? maxlen : stoplen;
+	i = 0;
+
+	/*
+	 * Scan a word at a time once SRC is aligned. An aligned word
+	 * never straddles a page, so reading the bytes after the null in
+	 * the word that holds it can't fault where a bytewise copy
+	 * wouldn't have. The word holding the null, and anything that
+	 * would run past LIMIT, are left to the byte loop.
+	 */
+	while (i < limit && ((uintptr_t)(src + i) & 3) != 0) {
 		dest[i] = src[i];
 		if (src[i] == 0) {
-			if (gotlen != NULL) {
-				*gotlen = i+1;
+			goto done;
+		}
+		i++;
+	}
+	if (((uintptr_t)(dest + i) & 3) == 0) {
+		while (limit - i >= 4) {
+			w = *(const uint32_t *)(src + i);
+			if (HASZERO(w)) {
+				break;
 			}
-			return 0;
+			*(uint32_t *)(dest + i) = w;
+			i += 4;
+		}
+	}
+	else {
+		while (limit - i >= 4) {
+			w = *(const uint32_t *)(src + i);
+			if (HASZERO(w)) {
+				break;
+			}
+			storeword(dest + i, w);
+			i += 4;
+		}
+	}
+
+	for (; i<limit; i++) {
+		dest[i] = src[i];
+		if (src[i] == 0) {
+			goto done;
 		}
 	}
 	if (stoplen < maxlen) {
@@ -252,6 +373,12 @@ copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	}
 	/* otherwise just ran out of space */
 	return ENAMETOOLONG;
+
+ done:
+	if (gotlen != NULL) {
+		*gotlen = i+1;
+	}
+	return 0;
 }
 
 /*
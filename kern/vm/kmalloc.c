@@ -28,11 +28,19 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
 #include <vm.h>
+#include <mainbus.h>
+#include <platform/maxcpus.h>
 #include <kern/test161.h>
 #include <test.h>
+#include "opt-dumbvm.h"
 
 /*
  * Kernel malloc.
@@ -162,10 +170,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole thing. Blocks that are freed and
+ * reallocated quickly mostly stay in the per-cpu magazines (below) and
+ * never get here.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -173,83 +180,90 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 ////////////////////////////////////////
 
 /*
- * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * The pagerefs live in one table, sized at boot for the amount of RAM
+ * we have (kheap_bootstrap), since there can't be more subpage heap
+ * pages than physical pages. It costs one pageref (16 bytes) per 4K
+ * page, plus a bit per pageref for the in-use bitmap.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Every bitmap word below pageref_hint is full, so allocation starts
+ * looking there and freeing only ever moves it down.
  */
 
 #define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
 
-struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
-};
-
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
+static struct pageref *pagerefs;
+static uint32_t *pagerefs_inuse;
+static unsigned num_pagerefs;
+static unsigned pageref_hint;
 
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
-};
+#define PAGEREF_WORDS (num_pagerefs / 32)
 
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * Index of the lowest clear bit in W, which must not be all ones.
  */
+static
+unsigned
+ffz32(uint32_t w)
+{
+	unsigned bit = 0;
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+	w = ~w;
+	KASSERT(w != 0);
+	if ((w & 0xffff) == 0) {
+		w >>= 16;
+		bit += 16;
+	}
+	if ((w & 0xff) == 0) {
+		w >>= 8;
+		bit += 8;
+	}
+	if ((w & 0xf) == 0) {
+		w >>= 4;
+		bit += 4;
+	}
+	if ((w & 0x3) == 0) {
+		w >>= 2;
+		bit += 2;
+	}
+	if ((w & 0x1) == 0) {
+		bit += 1;
+	}
+	return bit;
+}
 
 /*
- * Allocate a page to hold pagerefs.
+ * Set up the pageref table. Called once RAM has been found and before
+ * the first kmalloc.
  */
-static
 void
-allocpagerefpage(struct kheap_root *root)
+kheap_bootstrap(void)
 {
+	size_t ramsize, bytes;
+	unsigned npages;
 	vaddr_t va;
 
-	KASSERT(root->page == NULL);
+	KASSERT(pagerefs == NULL);
 
-	/*
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
-	spinlock_release(&kmalloc_spinlock);
-	va = alloc_kpages(1);
-	spinlock_acquire(&kmalloc_spinlock);
-	if (va == 0) {
-		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
+	/* Only as much as ram_bootstrap will use */
+	ramsize = mainbus_ramsize();
+	if (ramsize > 512*1024*1024) {
+		ramsize = 512*1024*1024;
 	}
-	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
-	}
+	/* Whole pages of pagerefs, which makes a whole number of words */
+	npages = DIVROUNDUP(ramsize / PAGE_SIZE, NPAGEREFS_PER_PAGE);
+	num_pagerefs = npages * NPAGEREFS_PER_PAGE;
+	KASSERT(num_pagerefs % 32 == 0);
 
-	root->page = (struct pagerefpage *)va;
+	bytes = num_pagerefs * sizeof(struct pageref) + PAGEREF_WORDS * 4;
+	va = alloc_kpages(DIVROUNDUP(bytes, PAGE_SIZE));
+	if (va == 0) {
+		panic("kheap_bootstrap: Out of memory\n");
+	}
+	pagerefs = (struct pageref *)va;
+	pagerefs_inuse = (uint32_t *)(pagerefs + num_pagerefs);
+	bzero(pagerefs_inuse, PAGEREF_WORDS * 4);
+	pageref_hint = 0;
 }
 
 /*
@@ -259,43 +273,22 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
-		}
+	unsigned i, j;
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pagerefs != NULL);
+
+	for (i=pageref_hint; i<PAGEREF_WORDS; i++) {
+		if (pagerefs_inuse[i] != 0xffffffff) {
+			j = ffz32(pagerefs_inuse[i]);
+			pagerefs_inuse[i] |= (uint32_t)1 << j;
+			pageref_hint = i;
+			return &pagerefs[i*32 + j];
 		}
 	}
 
 	/* ran out */
+	pageref_hint = i;
 	return NULL;
 }
 
@@ -308,34 +301,19 @@ freepageref(struct pageref *p)
 {
 	size_t i, j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
 
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
+	j = p - pagerefs;
+	/* note: j is unsigned, don't test < 0 */
+	KASSERT(j < num_pagerefs);
+	i = j/32;
+	k = ((uint32_t)1) << (j%32);
+	KASSERT((pagerefs_inuse[i] & k) != 0);
+	pagerefs_inuse[i] &= ~k;
+	if (i < pageref_hint) {
+		pageref_hint = i;
 	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
 }
 
 ////////////////////////////////////////
@@ -590,14 +568,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(sc < num_pagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
+		KASSERT(ac < num_pagerefs);
 		ac++;
 	}
 
@@ -699,6 +677,361 @@ dump_subpages(unsigned generation)
 
 #endif /* LABELS */
 
+////////////////////////////////////////
+
+/*
+ * Allocation-site profiling.
+ *
+ * While it's switched on (khprof on), each kmalloc is charged to the
+ * address it was called from, and each block is remembered with its
+ * site, size and time so that kfree can charge its lifetime and take
+ * it back off the site's live bytes. Sizes are what the block really
+ * takes up: the subpage block size, or whole pages.
+ *
+ * khgen takes a snapshot, so the report can give the allocation rate
+ * and live-byte growth since then. Blocks allocated before profiling
+ * started aren't tracked, nor are any beyond KPROF_NLIVE at once;
+ * freeing them costs a failed lookup.
+ *
+ * Unlike LABELS this doesn't change the heap layout, and when it's off
+ * it costs kmalloc and kfree one test of kprof_on.
+ */
+
+#define KPROF_NSITES	256	/* power of 2 */
+#define KPROF_NLIVE	4096
+#define KPROF_NBUCKETS	1024	/* power of 2 */
+
+#define KPROF_SITEHASH(site) (((site) >> 2) & (KPROF_NSITES - 1))
+#define KPROF_PTRHASH(ptr) \
+	((((vaddr_t)(ptr) >> 4) ^ ((vaddr_t)(ptr) >> 14)) & (KPROF_NBUCKETS - 1))
+
+struct kprof_site {
+	vaddr_t ks_site;		/* caller of kmalloc; 0 if unused */
+	unsigned ks_allocs;
+	uint64_t ks_bytes;		/* total bytes allocated */
+	unsigned ks_live;		/* tracked blocks not yet freed */
+	size_t ks_livebytes;
+	unsigned ks_frees;		/* tracked blocks freed */
+	uint64_t ks_lifetime;		/* of those, in ns */
+	unsigned ks_genallocs;		/* ks_allocs at the last khgen */
+	size_t ks_genlivebytes;		/* ks_livebytes at the last khgen */
+};
+
+struct kprof_block {
+	void *kb_ptr;
+	size_t kb_size;
+	struct kprof_site *kb_site;
+	uint64_t kb_time;		/* when it was allocated, in ns */
+	struct kprof_block *kb_next;	/* hash chain, or free list */
+};
+
+struct kprof {
+	struct kprof_site sites[KPROF_NSITES];
+	struct kprof_site other;	/* everything once sites[] fills */
+	unsigned nsites;
+	struct kprof_block blocks[KPROF_NLIVE];
+	struct kprof_block *buckets[KPROF_NBUCKETS];
+	struct kprof_block *freeblocks;
+	unsigned untracked;		/* allocations with no block free */
+	uint64_t starttime;
+	uint64_t gentime;
+};
+
+/*
+ * kprof_on is read without the lock as a fast check; kprof itself is
+ * only touched with kprof_spinlock held.
+ */
+static bool kprof_on;
+static struct kprof *kprof;
+static struct spinlock kprof_spinlock = SPINLOCK_INITIALIZER;
+
+static
+uint64_t
+kprof_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+struct kprof_site *
+kprof_findsite(vaddr_t site)
+{
+	struct kprof_site *ks;
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&kprof_spinlock));
+
+	/* One slot always stays empty, so a miss ends the probe */
+	i = KPROF_SITEHASH(site);
+	for (n=0; n<KPROF_NSITES; n++) {
+		ks = &kprof->sites[i];
+		if (ks->ks_site == site) {
+			return ks;
+		}
+		if (ks->ks_site == 0) {
+			if (kprof->nsites >= KPROF_NSITES - 1) {
+				break;
+			}
+			ks->ks_site = site;
+			kprof->nsites++;
+			return ks;
+		}
+		i = (i + 1) & (KPROF_NSITES - 1);
+	}
+	return &kprof->other;
+}
+
+static
+void
+kprof_alloc(void *ptr, size_t size, vaddr_t site)
+{
+	struct kprof_site *ks;
+	struct kprof_block *kb;
+	uint64_t now;
+	unsigned h;
+
+	now = kprof_now();
+
+	spinlock_acquire(&kprof_spinlock);
+	if (kprof == NULL) {
+		spinlock_release(&kprof_spinlock);
+		return;
+	}
+	ks = kprof_findsite(site);
+	ks->ks_allocs++;
+	ks->ks_bytes += size;
+
+	kb = kprof->freeblocks;
+	if (kb == NULL) {
+		kprof->untracked++;
+		spinlock_release(&kprof_spinlock);
+		return;
+	}
+	kprof->freeblocks = kb->kb_next;
+
+	kb->kb_ptr = ptr;
+	kb->kb_size = size;
+	kb->kb_site = ks;
+	kb->kb_time = now;
+	h = KPROF_PTRHASH(ptr);
+	kb->kb_next = kprof->buckets[h];
+	kprof->buckets[h] = kb;
+
+	ks->ks_live++;
+	ks->ks_livebytes += size;
+	spinlock_release(&kprof_spinlock);
+}
+
+/*
+ * Must be called before the block is actually freed, so it can't be
+ * handed out again and tracked twice.
+ */
+static
+void
+kprof_free(void *ptr)
+{
+	struct kprof_block **kbp, *kb;
+	struct kprof_site *ks;
+	uint64_t now;
+
+	now = kprof_now();
+
+	spinlock_acquire(&kprof_spinlock);
+	if (kprof == NULL) {
+		spinlock_release(&kprof_spinlock);
+		return;
+	}
+	kbp = &kprof->buckets[KPROF_PTRHASH(ptr)];
+	while (*kbp != NULL && (*kbp)->kb_ptr != ptr) {
+		kbp = &(*kbp)->kb_next;
+	}
+	kb = *kbp;
+	if (kb == NULL) {
+		/* not tracked */
+		spinlock_release(&kprof_spinlock);
+		return;
+	}
+	*kbp = kb->kb_next;
+
+	ks = kb->kb_site;
+	KASSERT(ks->ks_live > 0);
+	ks->ks_live--;
+	ks->ks_livebytes -= kb->kb_size;
+	ks->ks_frees++;
+	if (now > kb->kb_time) {
+		ks->ks_lifetime += now - kb->kb_time;
+	}
+
+	kb->kb_next = kprof->freeblocks;
+	kprof->freeblocks = kb;
+	spinlock_release(&kprof_spinlock);
+}
+
+/*
+ * Start profiling, or start over if it was already on.
+ */
+int
+kheap_profstart(void)
+{
+	struct kprof *kp, *old;
+	unsigned i;
+
+	kp = kmalloc(sizeof(*kp));
+	if (kp == NULL) {
+		return ENOMEM;
+	}
+	bzero(kp, sizeof(*kp));
+	for (i=0; i<KPROF_NLIVE; i++) {
+		kp->blocks[i].kb_next = kp->freeblocks;
+		kp->freeblocks = &kp->blocks[i];
+	}
+	kp->starttime = kp->gentime = kprof_now();
+
+	spinlock_acquire(&kprof_spinlock);
+	old = kprof;
+	kprof = kp;
+	kprof_on = true;
+	spinlock_release(&kprof_spinlock);
+
+	kfree(old);
+	return 0;
+}
+
+void
+kheap_profstop(void)
+{
+	struct kprof *old;
+
+	spinlock_acquire(&kprof_spinlock);
+	old = kprof;
+	kprof = NULL;
+	kprof_on = false;
+	spinlock_release(&kprof_spinlock);
+
+	kfree(old);
+}
+
+/*
+ * Called for khgen: remember where every site is now.
+ */
+static
+void
+kprof_snapshot(void)
+{
+	uint64_t now;
+	unsigned i;
+
+	if (!kprof_on) {
+		return;
+	}
+	now = kprof_now();
+
+	spinlock_acquire(&kprof_spinlock);
+	if (kprof != NULL) {
+		for (i=0; i<KPROF_NSITES; i++) {
+			kprof->sites[i].ks_genallocs = kprof->sites[i].ks_allocs;
+			kprof->sites[i].ks_genlivebytes =
+				kprof->sites[i].ks_livebytes;
+		}
+		kprof->other.ks_genallocs = kprof->other.ks_allocs;
+		kprof->other.ks_genlivebytes = kprof->other.ks_livebytes;
+		kprof->gentime = now;
+	}
+	spinlock_release(&kprof_spinlock);
+}
+
+/*
+ * Print every site, most live bytes first. The sites are copied out
+ * under the lock and printed from the copy.
+ */
+void
+kheap_printprofile(void)
+{
+	struct kprof_site *sites, tmp;
+	unsigned nsites, untracked, i, j;
+	uint64_t starttime, gentime, now, rate, life;
+	long growth;
+
+	sites = kmalloc((KPROF_NSITES + 1) * sizeof(*sites));
+	if (sites == NULL) {
+		kprintf("khprof: Out of memory\n");
+		return;
+	}
+
+	spinlock_acquire(&kprof_spinlock);
+	if (kprof == NULL) {
+		spinlock_release(&kprof_spinlock);
+		kfree(sites);
+		kprintf("Heap profiling is off; khprof on starts it.\n");
+		return;
+	}
+	nsites = 0;
+	for (i=0; i<KPROF_NSITES; i++) {
+		if (kprof->sites[i].ks_site != 0) {
+			sites[nsites++] = kprof->sites[i];
+		}
+	}
+	if (kprof->other.ks_allocs > 0) {
+		sites[nsites++] = kprof->other;
+	}
+	untracked = kprof->untracked;
+	starttime = kprof->starttime;
+	gentime = kprof->gentime;
+	spinlock_release(&kprof_spinlock);
+
+	now = kprof_now();
+
+	/* insertion sort */
+	for (i=1; i<nsites; i++) {
+		tmp = sites[i];
+		for (j=i; j>0 && sites[j-1].ks_livebytes < tmp.ks_livebytes;
+		     j--) {
+			sites[j] = sites[j-1];
+		}
+		sites[j] = tmp;
+	}
+
+	kprintf("Heap profile: %u sites, %llu ms since start, "
+		"%llu ms since khgen, %u allocations untracked\n",
+		nsites, (unsigned long long)((now - starttime) / 1000000),
+		(unsigned long long)((now - gentime) / 1000000), untracked);
+	kprintf("%-10s %8s %8s %6s %9s %9s %9s\n", "site", "allocs",
+		"allocs/s", "live", "livebytes", "+bytes", "life(ms)");
+	for (i=0; i<nsites; i++) {
+		rate = 0;
+		if (now > gentime) {
+			rate = (uint64_t)(sites[i].ks_allocs -
+					  sites[i].ks_genallocs) *
+				1000000000 / (now - gentime);
+		}
+		life = 0;
+		if (sites[i].ks_frees > 0) {
+			life = sites[i].ks_lifetime / sites[i].ks_frees /
+				1000000;
+		}
+		growth = (long)sites[i].ks_livebytes -
+			(long)sites[i].ks_genlivebytes;
+		if (sites[i].ks_site == 0) {
+			kprintf("%-10s ", "(other)");
+		}
+		else {
+			kprintf("0x%08lx ", (unsigned long)sites[i].ks_site);
+		}
+		kprintf("%8u %8llu %6u %9lu %+9ld %9llu\n",
+			sites[i].ks_allocs, (unsigned long long)rate,
+			sites[i].ks_live,
+			(unsigned long)sites[i].ks_livebytes, growth,
+			(unsigned long long)life);
+	}
+
+	kfree(sites);
+}
+
+////////////////////////////////////////
+
 void
 kheap_nextgeneration(void)
 {
@@ -707,6 +1040,7 @@ kheap_nextgeneration(void)
 	mallocgeneration++;
 	spinlock_release(&kmalloc_spinlock);
 #endif
+	kprof_snapshot();
 }
 
 void
@@ -741,6 +1075,205 @@ kheap_dumpall(void)
 
 ////////////////////////////////////////
 
+/*
+ * Per-cpu magazines.
+ *
+ * Each CPU keeps, for each block size, two magazines of free blocks:
+ * short lists threaded through the blocks themselves. kfree pushes
+ * onto the loaded one and kmalloc pops from it, with interrupts off
+ * but no lock. When the loaded magazine is empty (on kmalloc) or full
+ * (on kfree) it is swapped with the previous one, and only if that
+ * doesn't help do we go to the depot, a per-size list of full
+ * magazines under magazine_spinlock. A miss there falls through to
+ * the subpage allocator proper.
+ *
+ * A magazine holds at most a page's worth of blocks, so the cache for
+ * big blocks stays small, and the depot keeps at most DEPOT_MAXFULL
+ * full magazines per size; beyond that, frees go to the subpage
+ * allocator too.
+ *
+ * The debugging options want to see every kmalloc and kfree, so
+ * magazines are off when any of them are on.
+ */
+
+#if !defined(SLOW) && !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
+#ifdef MAGAZINES
+
+#define MAG_ROUNDS	16
+#define MAG_SIZE(blktype) \
+	(PAGE_SIZE / sizes[blktype] < MAG_ROUNDS ? \
+	 PAGE_SIZE / sizes[blktype] : MAG_ROUNDS)
+#define DEPOT_MAXFULL	4
+
+/* A free block while it sits in a magazine */
+struct maground {
+	struct maground *mr_next;	/* next block in this magazine */
+	struct maground *mr_nextmag;	/* next full magazine in the depot */
+};
+
+struct magazine {
+	struct maground *mag_head;
+	unsigned mag_count;
+};
+
+struct magcache {
+	struct magazine mc_loaded;
+	struct magazine mc_previous;
+};
+
+struct depot {
+	struct maground *d_full;	/* heads of full magazines */
+	unsigned d_nfull;
+};
+
+static struct magcache magcaches[MAXCPUS][NSIZES];
+static struct depot depots[NSIZES];
+static struct spinlock magazine_spinlock = SPINLOCK_INITIALIZER;
+
+static
+inline
+void
+mag_swap(struct magcache *mc)
+{
+	struct magazine tmp;
+
+	tmp = mc->mc_loaded;
+	mc->mc_loaded = mc->mc_previous;
+	mc->mc_previous = tmp;
+}
+
+/*
+ * Get a block of type BLKTYPE from this CPU's magazines or the depot,
+ * or NULL if there are none cached.
+ */
+static
+void *
+mag_alloc(int blktype)
+{
+	struct magcache *mc;
+	struct depot *d;
+	struct maground *mr;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	mc = &magcaches[curcpu->c_number][blktype];
+	if (mc->mc_loaded.mag_count == 0) {
+		if (mc->mc_previous.mag_count > 0) {
+			mag_swap(mc);
+		}
+		else {
+			/* Both empty; trade for a full one from the depot */
+			d = &depots[blktype];
+			spinlock_acquire(&magazine_spinlock);
+			mr = d->d_full;
+			if (mr != NULL) {
+				d->d_full = mr->mr_nextmag;
+				d->d_nfull--;
+			}
+			spinlock_release(&magazine_spinlock);
+			if (mr == NULL) {
+				splx(spl);
+				return NULL;
+			}
+			mc->mc_loaded.mag_head = mr;
+			mc->mc_loaded.mag_count = MAG_SIZE(blktype);
+		}
+	}
+
+	mr = mc->mc_loaded.mag_head;
+	mc->mc_loaded.mag_head = mr->mr_next;
+	mc->mc_loaded.mag_count--;
+	splx(spl);
+	return mr;
+}
+
+/*
+ * Put PTR, a block of type BLKTYPE, in this CPU's magazines. False if
+ * there is no room for it anywhere, in which case the caller has to
+ * give it back to the subpage allocator.
+ */
+static
+bool
+mag_free(void *ptr, int blktype)
+{
+	struct magcache *mc;
+	struct depot *d;
+	struct maground *mr = ptr;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+
+	spl = splhigh();
+	mc = &magcaches[curcpu->c_number][blktype];
+	if (mc->mc_loaded.mag_count == MAG_SIZE(blktype)) {
+		if (mc->mc_previous.mag_count < MAG_SIZE(blktype)) {
+			mag_swap(mc);
+		}
+		else {
+			/* Both full; send one to the depot if it has room */
+			d = &depots[blktype];
+			spinlock_acquire(&magazine_spinlock);
+			if (d->d_nfull >= DEPOT_MAXFULL) {
+				spinlock_release(&magazine_spinlock);
+				splx(spl);
+				return false;
+			}
+			mc->mc_previous.mag_head->mr_nextmag = d->d_full;
+			d->d_full = mc->mc_previous.mag_head;
+			d->d_nfull++;
+			spinlock_release(&magazine_spinlock);
+			mc->mc_previous = mc->mc_loaded;
+			mc->mc_loaded.mag_head = NULL;
+			mc->mc_loaded.mag_count = 0;
+		}
+	}
+
+	mr->mr_next = mc->mc_loaded.mag_head;
+	mc->mc_loaded.mag_head = mr;
+	mc->mc_loaded.mag_count++;
+	splx(spl);
+	return true;
+}
+
+/*
+ * Bytes sitting in magazines, which the subpage allocator counts as
+ * in use. Other CPUs' counts are read without their cooperation, so
+ * this is only a snapshot.
+ */
+static
+unsigned long
+mag_cachedbytes(void)
+{
+	unsigned long total = 0;
+	unsigned i, k;
+
+	spinlock_acquire(&magazine_spinlock);
+	for (k=0; k<NSIZES; k++) {
+		total += (unsigned long)depots[k].d_nfull * MAG_SIZE(k) *
+			sizes[k];
+		for (i=0; i<MAXCPUS; i++) {
+			total += (unsigned long)sizes[k] *
+				(magcaches[i][k].mc_loaded.mag_count +
+				 magcaches[i][k].mc_previous.mag_count);
+		}
+	}
+	spinlock_release(&magazine_spinlock);
+	return total;
+}
+
+#endif /* MAGAZINES */
+
+////////////////////////////////////////
+
 /*
  * Print the allocated/freed map of a single kernel heap page.
  */
@@ -847,6 +1380,12 @@ kheap_getused(void) {
 
 	spinlock_release(&kmalloc_spinlock);
 
+#ifdef MAGAZINES
+	// Blocks cached in magazines have been freed as far as callers
+	// are concerned.
+	total -= mag_cachedbytes();
+#endif
+
 	return total;
 }
 
@@ -1061,10 +1600,86 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+#if !OPT_DUMBVM
+	coremap_setkheap(prpage, pr);
+#endif
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Find the pageref for the heap page holding PTRADDR, or NULL if it
+ * isn't on one, and check that PTRADDR is the start of a block.
+ *
+ * Normally the coremap points straight at the pageref, and for a block
+ * that is allocated that can't change under us, so no lock is needed.
+ * dumbvm has no coremap; then we search allbase, with kmalloc_spinlock
+ * held.
+ */
+static
+struct pageref *
+subpage_find(vaddr_t ptraddr)
+{
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	int blktype;		// index into sizes[] that we're using
+
+#if OPT_DUMBVM
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr)<NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			break;
+		}
+	}
+#else
+	pr = coremap_getkheap(ptraddr);
+#endif
+	if (pr == NULL) {
+		return NULL;
+	}
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE);
+
+	/* Check for proper positioning and alignment */
+	if ((ptraddr - prpage) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr 0x%lx\n",
+		      (unsigned long)ptraddr);
+	}
+	return pr;
+}
+
+#ifdef MAGAZINES
+/*
+ * Block type of a subpage block, or -1 if PTR isn't one.
+ */
+static
+int
+subpage_blocktype(void *ptr)
+{
+	struct pageref *pr;
+
+#if OPT_DUMBVM
+	spinlock_acquire(&kmalloc_spinlock);
+	pr = subpage_find((vaddr_t)ptr);
+	spinlock_release(&kmalloc_spinlock);
+#else
+	pr = subpage_find((vaddr_t)ptr);
+#endif
+	return pr == NULL ? -1 : (int)PR_BLOCKTYPE(pr);
+}
+#endif
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1109,41 +1724,27 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
+#if !OPT_DUMBVM
+	/* Whole-page allocations get out without touching the lock */
+	if (coremap_getkheap(ptraddr) == NULL) {
+		return -1;
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_find(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
-
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
-	}
-
 #ifdef GUARDS
 	blocksize = sizes[blktype];
 	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
@@ -1189,6 +1790,9 @@ subpage_kfree(void *ptr)
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
+#if !OPT_DUMBVM
+		coremap_setkheap(prpage, NULL);
+#endif
 		freepageref(pr);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
@@ -1212,23 +1816,17 @@ subpage_kfree(void *ptr)
 
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * alloc_kpages depending on how big SZ is. LABEL is kmalloc's caller.
  */
+static
 void *
-kmalloc(size_t sz)
+kmalloc_block(size_t sz, vaddr_t label)
 {
 	size_t checksz;
-#ifdef LABELS
-	vaddr_t label;
-#endif
 
-#ifdef LABELS
-#ifdef __GNUC__
-	label = (vaddr_t)__builtin_return_address(0);
-#else
-#error "Don't know how to get return address with this compiler"
-#endif /* __GNUC__ */
-#endif /* LABELS */
+#ifndef LABELS
+	(void)label;
+#endif
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
@@ -1249,10 +1847,43 @@ kmalloc(size_t sz)
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
+#ifdef MAGAZINES
+	{
+		void *ptr;
+
+		ptr = mag_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
 	return subpage_kmalloc(sz);
 #endif
 }
 
+void *
+kmalloc(size_t sz)
+{
+	vaddr_t label;
+	size_t checksz;
+	void *ptr;
+
+#ifdef __GNUC__
+	label = (vaddr_t)__builtin_return_address(0);
+#else
+#error "Don't know how to get return address with this compiler"
+#endif /* __GNUC__ */
+
+	ptr = kmalloc_block(sz, label);
+	if (kprof_on && ptr != NULL) {
+		checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
+		kprof_alloc(ptr, checksz >= LARGEST_SUBPAGE_SIZE ?
+			    ROUNDUP(sz, PAGE_SIZE) : sizes[blocktype(checksz)],
+			    label);
+	}
+	return ptr;
+}
+
 /*
  * Free a block previously returned from kmalloc.
  */
@@ -1264,7 +1895,21 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	if (kprof_on) {
+		kprof_free(ptr);
+	}
+#ifdef MAGAZINES
+	{
+		int blktype;
+
+		blktype = subpage_blocktype(ptr);
+		if (blktype >= 0 && mag_free(ptr, blktype)) {
+			return;
+		}
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,136 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem_cache.h>
+
+/*
+ * Object caches; see kmem_cache.h. Objects come from kmalloc, so the
+ * per-cpu magazines there already make the raw allocation cheap; what
+ * a cache saves is the constructor and destructor work.
+ *
+ * A cache goes on kmem_caches the first time it keeps an object, so
+ * caches need no registration step.
+ */
+
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+/* Destroy everything KC is holding; returns how many that was */
+static
+unsigned
+kmem_cache_drain(struct kmem_cache *kc)
+{
+	void *obj;
+	unsigned n = 0;
+
+	while (1) {
+		spinlock_acquire(&kc->kc_lock);
+		if (kc->kc_nfree == 0) {
+			spinlock_release(&kc->kc_lock);
+			return n;
+		}
+		obj = kc->kc_free[--kc->kc_nfree];
+		spinlock_release(&kc->kc_lock);
+
+		if (kc->kc_dtor != NULL) {
+			kc->kc_dtor(obj);
+		}
+		kfree(obj);
+		n++;
+	}
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_hits++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	kc->kc_misses++;
+	spinlock_release(&kc->kc_lock);
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0) {
+		kfree(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+	KASSERT(kc->kc_maxfree <= KMEM_CACHE_MAXFREE);
+
+	if (!kc->kc_listed) {
+		spinlock_acquire(&kmem_caches_lock);
+		if (!kc->kc_listed) {
+			kc->kc_next = kmem_caches;
+			kmem_caches = kc;
+			kc->kc_listed = true;
+		}
+		spinlock_release(&kmem_caches_lock);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nfree < kc->kc_maxfree) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Caches are static and only ever go on the head of the list, so once
+ * we have the head we can walk it without kmem_caches_lock while the
+ * destructors run.
+ */
+unsigned
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+	unsigned n = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	for (; kc != NULL; kc = kc->kc_next) {
+		n += kmem_cache_drain(kc);
+	}
+	return n;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	kprintf("Object caches:\n");
+	for (; kc != NULL; kc = kc->kc_next) {
+		kprintf("  %-16s %5lu bytes  %2u/%-2u free  %u hits, "
+			"%u misses\n", kc->kc_name, (unsigned long)kc->kc_size,
+			kc->kc_nfree, kc->kc_maxfree, kc->kc_hits,
+			kc->kc_misses);
+	}
+}
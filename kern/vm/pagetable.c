@@ -1,122 +1,128 @@
-#include <pagetable.h>
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <kmem_cache.h>
+
+/*
+ * Both levels are a page each. Cached directories are all NULL and
+ * cached second-level tables all zero, which is how pagetable_destroy
+ * and vm_pte_release leave them, so neither needs clearing on reuse.
+ */
+static
+int
+pt_dir_ctor(void *obj){
+	struct pagetable *pt = obj;
+	int i;
 
-page_entry *destroy_pagetable(page_entry *page_table){
-	while(page_table != NULL){
-		page_table = pop(&page_table);
+	for(i = 0; i < PT_ENTRIES; i++){
+		pt->pt_dir[i] = NULL;
 	}
-	return page_table;
+	return 0;
 }
 
-page_entry * pop(page_entry **page_table){
-	page_entry *temp = NULL;
-	if(*page_table == NULL){
-		kprintf("Page_table is NULL");	
-	}
-	temp = (*page_table)->next;
-	free_upages((*page_table)->pas);
+static
+int
+pt_l2_ctor(void *obj){
+	bzero(obj, PT_ENTRIES * sizeof(pte_t));
+	return 0;
+}
 
-	kfree(*page_table);
+static struct kmem_cache pt_dir_cache =
+	KMEM_CACHE_INITIALIZER("page directory", sizeof(struct pagetable), 4,
+			       pt_dir_ctor, NULL);
+static struct kmem_cache pt_l2_cache =
+	KMEM_CACHE_INITIALIZER("page table", PT_ENTRIES * sizeof(pte_t), 16,
+			       pt_l2_ctor, NULL);
 
-	*page_table = temp;
-	return *page_table;
+struct pagetable *pagetable_create(void){
+	return kmem_cache_alloc(&pt_dir_cache);
 }
 
-void print_list(page_entry *page_table){
-	page_entry *current = page_table;
-	if(current == NULL){
-		kprintf("The list is empty good sir");
-	}
-	while(current != NULL){
-		kprintf("%d\n", current->vpn);
-		current = current->next;
+void pagetable_destroy(struct pagetable *pt){
+	int i;
+
+	/* One coremap lock hold per second-level table */
+	for(i = 0; i < PT_ENTRIES; i++){
+		if(pt->pt_dir[i] == NULL){
+			continue;
+		}
+		vm_pte_release(pt->pt_dir[i], PT_ENTRIES, NULL);
+		kmem_cache_free(&pt_l2_cache, pt->pt_dir[i]);
+		pt->pt_dir[i] = NULL;
 	}
+	kmem_cache_free(&pt_dir_cache, pt);
 }
 
-int push_pte(struct page_entry **pt, vaddr_t vpn){
-	/* Need to do a check on the head to see if NULL */
-/*	if((*pt)->vpn == 0){
-		(*pt)->vpn = vpn;
-		(*pt)->pas = alloc_upages(1);
-		return 0;	
-	}
-*/
-	struct page_entry *new_pte;
-	new_pte = kmalloc(sizeof(*new_pte));
+pte_t *pagetable_lookup(struct pagetable *pt, vaddr_t va, bool create){
+	pte_t *l2;
 
-	if(new_pte == NULL){
-		kprintf("No mem for new pte");
-		return -1;
-	}
-	
-	new_pte->vpn = vpn;
-	new_pte->pas = alloc_upages(1); //!!!!!!!!!!!!!!!UNCOMMENT!!!!!!!!!!
-	if(new_pte->pas == 0){
-		kprintf("Paddr is 0");
-		return -1;
+	l2 = pt->pt_dir[PT_L1_INDEX(va)];
+	if(l2 == NULL){
+		if(!create){
+			return NULL;
+		}
+		l2 = kmem_cache_alloc(&pt_l2_cache);
+		if(l2 == NULL){
+			return NULL;
+		}
+		pt->pt_dir[PT_L1_INDEX(va)] = l2;
 	}
-	bzero((void*)PADDR_TO_KVADDR(new_pte->pas),PAGE_SIZE);		
-	new_pte->next = *pt;
-	*pt = new_pte;
-	
-	return 0;
+	return &l2[PT_L2_INDEX(va)];
 }
-page_entry * find_vaddr(page_entry *page_table, vaddr_t va){
-	page_entry *current = page_table;
 
-	while(current != NULL){
-		/* To be fixed when page entry gets set up with addr */
-		if(current->next->vpn == va){
-			return current->next;	
+int pagetable_copy(struct pagetable *old, struct pagetable *new,
+		   struct vm_usage *usage){
+	pte_t *newl2;
+	int i;
+
+	for(i = 0; i < PT_ENTRIES; i++){
+		if(old->pt_dir[i] == NULL){
+			continue;
 		}
-}
-	return NULL;
+		newl2 = pagetable_lookup(new, (vaddr_t)i << 22, true);
+		if(newl2 == NULL){
+			return ENOMEM;
+		}
+		vm_pte_share(old->pt_dir[i], newl2, PT_ENTRIES, usage);
+	}
+	return 0;
 }
 
-void remove(page_entry **page_table, vaddr_t va){
-	page_entry *current = *page_table;
-	page_entry *temp = NULL;
+void pagetable_unmap_range(struct pagetable *pt, vaddr_t start, vaddr_t end,
+			   struct vm_usage *usage){
+	pte_t *l2;
+	vaddr_t va;
+	unsigned n;
 
-	while(current != NULL){
-		/* To be fixed when page entry gets set up with addr */
-		if(current->next->vpn == va){
-			temp = current->next;
-			current->next = temp->next;
-			break;
+	va = start & PAGE_FRAME;
+	while(va < end){
+		/* Release up to the end of this second-level table at once */
+		n = PT_ENTRIES - PT_L2_INDEX(va);
+		if(n > (end - va + PAGE_SIZE - 1) / PAGE_SIZE){
+			n = (end - va + PAGE_SIZE - 1) / PAGE_SIZE;
+		}
+		l2 = pt->pt_dir[PT_L1_INDEX(va)];
+		if(l2 != NULL){
+			vm_pte_release(&l2[PT_L2_INDEX(va)], n, usage);
 		}
-		current = current->next;
+		va += n * PAGE_SIZE;
 	}
-
-	kfree(temp);
 }
 
-/* Return the permissions all in one int 
- * e.g read - 4, write - 2, exex - 1
- * return int 421
- */
-int concat_permissions(int read, int write, int exec){
-	int array[3];
-	array[0] = read;
-	array[1] = write;
-	array[2] = exec;
-	int concat = array[0];
-	int index = 1;
-	while(index < 3){
-		concat = concat * 10;
-		concat+=array[index];
-		index++;
-	}
-	return concat;
-}
+/* Translate the ELF-style flags that as_define_region receives */
+pte_t pte_permissions(int readable, int writeable, int executable){
+	pte_t perms = 0;
 
-int * get_permissions(int concat){
-	int *array;
-	array = NULL;
-	int index = 0;
-	while(index < 3){
-		array[index] = concat % 10;
-		concat = concat/10;
+	if(readable){
+		perms |= PTE_READ;
 	}
-	return array;	
-}	
+	if(writeable){
+		perms |= PTE_WRITE;
+	}
+	if(executable){
+		perms |= PTE_EXEC;
+	}
+	return perms;
+}
@@ -0,0 +1,131 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+#define SWAP_DEVICE "lhd1:"
+
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;		/* Which slots are in use */
+static unsigned short *swap_refs;	/* References to each slot */
+static unsigned swap_nslots;
+static struct spinlock swap_spinlock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	int result;
+
+	result = vfs_swapon(SWAP_DEVICE, &swap_vnode);
+	if(result){
+		kprintf("swap: no swap on %s: %s\n", SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+	result = VOP_STAT(swap_vnode, &st);
+	if(result){
+		panic("swap: stat %s: %s\n", SWAP_DEVICE, strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	swap_refs = kmalloc(swap_nslots * sizeof(swap_refs[0]));
+	if(swap_map == NULL || swap_refs == NULL){
+		panic("swap: out of memory for %u slots\n", swap_nslots);
+	}
+	bzero(swap_refs, swap_nslots * sizeof(swap_refs[0]));
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	spinlock_acquire(&swap_spinlock);
+	result = bitmap_alloc(swap_map, slot);
+	if(result == 0){
+		KASSERT(swap_refs[*slot] == 0);
+		swap_refs[*slot] = 1;
+	}
+	spinlock_release(&swap_spinlock);
+	return result;
+}
+
+void
+swap_incref(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_spinlock);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]++;
+	spinlock_release(&swap_spinlock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_spinlock);
+	KASSERT(swap_refs[slot] > 0);
+	if(--swap_refs[slot] == 0){
+		bitmap_unmark(swap_map, slot);
+	}
+	spinlock_release(&swap_spinlock);
+}
+
+static
+int
+swap_io(unsigned slot, paddr_t pa, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if(rw == UIO_READ){
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else{
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if(result){
+		kprintf("swap: slot %u: %s\n", slot, strerror(result));
+		return result;
+	}
+	if(ku.uio_resid != 0){
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_in(unsigned slot, paddr_t pa)
+{
+	return swap_io(slot, pa, UIO_READ);
+}
+
+int
+swap_out(unsigned slot, paddr_t pa)
+{
+	return swap_io(slot, pa, UIO_WRITE);
+}
@@ -6,228 +6,1915 @@
 #include <pagetable.h>
 #include <proc.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <current.h>
 #include <addrspace.h>
 #include <mips/tlb.h>
 #include <spl.h>
+#include <uio.h>
+#include <vnode.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <wchan.h>
+#include <swap.h>
+#include <bitmap.h>
+#include <platform/maxcpus.h>
 
 struct coremap_entry *coremap;
 int NUM_ENTRIES;
 struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
 int bytes_left;
 
+/* Sleep here, with coremap_spinlock, for a PTE_BUSY page to settle */
+static struct wchan *coremap_wchan;
+
+/* One round of TLB shootdown IPIs at a time; see vm_shootdown */
+static struct lock *shootdown_lock;
+static struct semaphore *shootdown_sem;
+
+/* Clock hand for choosing pageout victims */
+static int clock_hand;
+
+/*
+ * Page cleaner state, under coremap_spinlock. coremap_nclean counts
+ * frames with a cm_slot, which the clock can take without writing.
+ */
+unsigned vm_cleaner_lowat;
+unsigned vm_cleaner_batch = 8;
+unsigned vm_faultaround_max = 8;
+struct vm_stats vm_stats;
+static struct wchan *cleaner_wchan;
+static bool cleaner_idle;
+static unsigned coremap_nclean;
+
+/* Pages wired by mlock, and the most there may be (half of RAM) */
+static unsigned coremap_nwired;
+#define VM_MAXWIRED ((unsigned)NUM_ENTRIES / 2)
+
+static void vm_cleaner(void *, unsigned long);
+
+/*
+ * Wake the cleaner if free and clean frames together have dropped
+ * below the low-water mark. Caller holds coremap_spinlock.
+ */
+static
+void
+cleaner_prod(void)
+{
+	if (cleaner_idle &&
+	    (unsigned)bytes_left / PAGE_SIZE + coremap_nclean < vm_cleaner_lowat) {
+		cleaner_idle = false;
+		vm_stats.vs_cleaner_wakeups++;
+		wchan_wakeone(cleaner_wchan, &coremap_spinlock);
+	}
+}
+
 /* VM functions */
 
-void vm_bootstrap()
-{
-    /* implement*/
+void vm_bootstrap()
+{
+	coremap_wchan = wchan_create("coremap");
+	shootdown_lock = lock_create("shootdown");
+	shootdown_sem = sem_create("shootdown", 0);
+	if (coremap_wchan == NULL || shootdown_lock == NULL ||
+	    shootdown_sem == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+	swap_bootstrap();
+
+	vm_zeropool_target = NUM_ENTRIES / 64 < 64 ? NUM_ENTRIES / 64 : 64;
+
+	if (swap_enabled()) {
+		vm_cleaner_lowat = NUM_ENTRIES / 32 > 8 ? NUM_ENTRIES / 32 : 8;
+		cleaner_wchan = wchan_create("cleaner");
+		if (cleaner_wchan == NULL) {
+			panic("vm_bootstrap: out of memory\n");
+		}
+		if (thread_fork("pagecleaner", NULL, vm_cleaner, NULL, 0)) {
+			panic("vm_bootstrap: cannot start the page cleaner\n");
+		}
+	}
+}
+
+/* We need to make alloc_upages and free_upages functions */
+
+/*
+ * Buddy free lists. freelists[k] heads a doubly linked list (through
+ * cm_next/cm_prev) of free blocks of 1<<k pages whose first coremap
+ * index is a multiple of 1<<k. Pages that are never recycled (kernel
+ * image, coremap) never carry a cm_order, so they fence off merging.
+ */
+static int freelists[COREMAP_NORDERS];
+
+static
+void
+freelist_insert(int index, int order)
+{
+	coremap[index].cm_order = order;
+	coremap[index].cm_prev = -1;
+	coremap[index].cm_next = freelists[order];
+	if (freelists[order] >= 0) {
+		coremap[freelists[order]].cm_prev = index;
+	}
+	freelists[order] = index;
+}
+
+static
+void
+freelist_remove(int index, int order)
+{
+	KASSERT(coremap[index].cm_order == order);
+
+	if (coremap[index].cm_prev >= 0) {
+		coremap[coremap[index].cm_prev].cm_next = coremap[index].cm_next;
+	}
+	else {
+		freelists[order] = coremap[index].cm_next;
+	}
+	if (coremap[index].cm_next >= 0) {
+		coremap[coremap[index].cm_next].cm_prev = coremap[index].cm_prev;
+	}
+	coremap[index].cm_order = -1;
+	coremap[index].cm_next = -1;
+	coremap[index].cm_prev = -1;
+}
+
+/*
+ * Return an aligned free block to its list, merging with its buddy
+ * for as long as the buddy is itself a free block of the same order.
+ */
+static
+void
+buddy_free_block(int index, int order)
+{
+	int buddy;
+
+	while (order < COREMAP_NORDERS - 1) {
+		buddy = index ^ (1 << order);
+		if (buddy + (1 << order) > NUM_ENTRIES ||
+		    coremap[buddy].cm_order != order) {
+			break;
+		}
+		freelist_remove(buddy, order);
+		if (buddy < index) {
+			index = buddy;
+		}
+		order++;
+	}
+	freelist_insert(index, order);
+}
+
+/*
+ * Hand an arbitrary run of pages back to the buddy lists by carving it
+ * into the largest naturally aligned power-of-two pieces.
+ */
+static
+void
+buddy_free_range(int index, int npages)
+{
+	int order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order < COREMAP_NORDERS - 1 &&
+		       (index & ((2 << order) - 1)) == 0 &&
+		       (2 << order) <= npages) {
+			order++;
+		}
+		buddy_free_block(index, order);
+		index += 1 << order;
+		npages -= 1 << order;
+	}
+}
+
+/* Smallest order whose blocks hold NPAGES pages, or -1 if none does */
+static
+int
+buddy_order(unsigned npages)
+{
+	int order;
+
+	for (order = 0; order < COREMAP_NORDERS; order++) {
+		if ((1U << order) >= npages) {
+			return order;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Take a block of order ORDER for NPAGES pages, splitting it off one of
+ * order K (the smallest nonempty list that is big enough) and handing
+ * any tail beyond NPAGES back. Caller holds coremap_spinlock.
+ */
+static
+int
+buddy_take(int k, int order, unsigned npages)
+{
+	int index;
+
+	index = freelists[k];
+	freelist_remove(index, k);
+	while (k > order) {
+		k--;
+		freelist_insert(index + (1 << k), k);
+	}
+	if ((1U << order) > npages) {
+		buddy_free_range(index + npages, (1 << order) - npages);
+	}
+	return index;
+}
+
+/*
+ * Pool of free frames that are already zeroed, chained through cm_next
+ * and refilled from cpu_idle. They count as free in bytes_left, but are
+ * out of the buddy lists with refcount 0 until handed out.
+ */
+unsigned vm_zeropool_target;
+static int zeropool = -1;
+static unsigned zeropool_count;
+
+/* Take a frame off the zero pool, or -1. Caller holds the lock. */
+static
+int
+zeropool_pop(void)
+{
+	int index;
+
+	index = zeropool;
+	if (index < 0) {
+		return -1;
+	}
+	zeropool = coremap[index].cm_next;
+	zeropool_count--;
+	coremap[index].cm_next = -1;
+	coremap[index].cm_refcount = 1;
+	bytes_left -= PAGE_SIZE;
+	return index;
+}
+
+/*
+ * Allocate some physically contiguous pages. One page comes straight
+ * off the order-0 list; larger runs split the smallest big-enough block
+ * and give any tail beyond NPAGES back, so this is O(log n) at worst.
+ */
+paddr_t
+get_ppages(unsigned npages){
+	
+	int order, k, index;
+	// Critical section. Protect the coremap
+	spinlock_acquire(&coremap_spinlock);
+	
+	order = buddy_order(npages);
+	if((int)(npages*PAGE_SIZE) > bytes_left || npages==0 || order < 0){
+		spinlock_release(&coremap_spinlock);
+		return 0;
+	}
+
+	for (k = order; k < COREMAP_NORDERS && freelists[k] < 0; k++) {
+		/* nothing */
+	}
+	if (k == COREMAP_NORDERS) {
+		/* Last resort for a single page: the zero pool */
+		index = npages == 1 ? zeropool_pop() : -1;
+		cleaner_prod();
+		spinlock_release(&coremap_spinlock);
+		return index < 0 ? 0 : coremap[index].pas;
+	}
+
+	index = buddy_take(k, order, npages);
+
+	for(unsigned n=0; n<npages; n++){
+		KASSERT(coremap[index+n].pg_state == PAGE_FREE);
+		KASSERT(coremap[index+n].use_state == REUSE);
+		if(n==0){
+			coremap[index+n].blk_state = BLOCK_PARENT;
+		}
+		else{
+			coremap[index+n].blk_state = BLOCK_CHILD;
+		}
+		coremap[index+n].block_size = npages;
+		coremap[index+n].pg_state = PAGE_FIXED;
+		coremap[index+n].cm_refcount = 1;
+	}
+	// Update bytes_left
+	bytes_left -= (npages*PAGE_SIZE);
+	cleaner_prod();
+	spinlock_release(&coremap_spinlock);
+	return coremap[index].pas;
+}
+
+static paddr_t vm_evict(void);
+static vaddr_t kva_alloc(unsigned npages);
+static void kva_free(vaddr_t va);
+
+/* True if we may sleep here: a thread, not an interrupt, no spinlocks */
+static
+bool
+vm_cansleep(void)
+{
+	return curthread != NULL && !curthread->t_in_interrupt &&
+		curcpu->c_spinlocks == 0;
+}
+
+/*
+ * Page something out to make room, if we are in a position to sleep.
+ * Only single pages come back this way; there is no point trying to
+ * evict our way to a contiguous run.
+ */
+static
+paddr_t
+get_ppages_evict(unsigned npages)
+{
+	paddr_t pa;
+
+	pa = get_ppages(npages);
+	if(pa == 0 && npages == 1 && vm_cansleep()){
+		pa = vm_evict();
+	}
+	return pa;
+}
+
+/*
+ * Multi-page requests that find no contiguous run fall back to the
+ * kernel virtual area, so the result may be in kseg2 rather than kseg0.
+ */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+	pa = get_ppages_evict(npages);
+	if(pa== 0){
+		return npages > 1 ? kva_alloc(npages) : 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+paddr_t 
+alloc_upages(unsigned npages){
+	paddr_t pa = get_ppages_evict(npages);	
+	return pa;
+}
+
+void free_pages(unsigned int addr, int index){	
+	/* Caller holds coremap_spinlock */
+	int n = coremap[index].block_size;
+	int npages = coremap[index].block_size;
+	int first = index;
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	while(n>0){
+		KASSERT(coremap[index].cm_kheap == NULL);
+		coremap[index].as = NULL;
+		coremap[index].block_size = 0;
+		coremap[index].pg_state = PAGE_FREE;
+		coremap[index].blk_state = BLOCK_CHILD;
+		coremap[index].cm_refcount = 0;
+		coremap[index].cm_pte = NULL;
+		coremap[index].cm_uvaddr = 0;
+		coremap[index].cm_busy = false;
+		coremap[index].cm_referenced = false;
+		if(coremap[index].cm_slot >= 0){
+			swap_free(coremap[index].cm_slot);
+			coremap[index].cm_slot = -1;
+			coremap_nclean--;
+		}
+		n--;
+		index++;
+	}
+	buddy_free_range(first, npages);
+	bytes_left += (npages*PAGE_SIZE);
+	(void)addr;
+}
+
+/*
+ * Map a physical address to its coremap index, or -1 if it does not
+ * name the first page of a freeable allocation.
+ */
+static
+int
+coremap_index(paddr_t addr)
+{
+	int index;
+
+	if (addr % PAGE_SIZE != 0 || addr / PAGE_SIZE >= (paddr_t)NUM_ENTRIES) {
+		return -1;
+	}
+	index = addr / PAGE_SIZE;
+	if(coremap[index].blk_state == BLOCK_CHILD ||
+		coremap[index].use_state == NO_REUSE ||
+		coremap[index].pg_state == PAGE_FREE){
+		return -1;
+	}
+	return index;
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	int index;
+
+	if (addr >= MIPS_KSEG2) {
+		kva_free(addr);
+		return;
+	}
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+
+	// Critical section. Protect the coremap
+	spinlock_acquire(&coremap_spinlock);
+	index = coremap_index(addr - MIPS_KSEG0);
+	if(index >= 0){
+		free_pages(addr, index);
+	}
+	spinlock_release(&coremap_spinlock);
+}
+
+void
+free_upages(paddr_t addr)
+{
+	int index;
+
+	// Critical section. Protect the coremap
+	spinlock_acquire(&coremap_spinlock);
+	index = coremap_index(addr);
+	if(index >= 0){
+		KASSERT(coremap[index].cm_refcount > 0);
+		if(--coremap[index].cm_refcount == 0){
+			free_pages(addr, index);
+		}
+	}
+	spinlock_release(&coremap_spinlock);
+}
+
+void
+coremap_setkheap(vaddr_t va, void *ref)
+{
+	KASSERT(va >= MIPS_KSEG0 && va < MIPS_KSEG1);
+	KASSERT((va - MIPS_KSEG0) / PAGE_SIZE < (unsigned)NUM_ENTRIES);
+	coremap[(va - MIPS_KSEG0) / PAGE_SIZE].cm_kheap = ref;
+}
+
+void *
+coremap_getkheap(vaddr_t va)
+{
+	paddr_t pa;
+
+	if (va < MIPS_KSEG0 || va >= MIPS_KSEG1) {
+		return NULL;
+	}
+	pa = va - MIPS_KSEG0;
+	if (pa / PAGE_SIZE >= (unsigned)NUM_ENTRIES) {
+		return NULL;
+	}
+	return coremap[pa / PAGE_SIZE].cm_kheap;
+}
+
+/*
+ * One user page that reads as zeros, off the zero pool if possible and
+ * zeroed here if not. NOEVICT as for get_ppages versus alloc_upages.
+ */
+static
+paddr_t
+alloc_upage_zeroed(bool noevict)
+{
+	paddr_t pa;
+	int index;
+
+	spinlock_acquire(&coremap_spinlock);
+	index = zeropool_pop();
+	if (index >= 0) {
+		vm_stats.vs_zero_hits++;
+		cleaner_prod();
+	}
+	spinlock_release(&coremap_spinlock);
+	if (index >= 0) {
+		return coremap[index].pas;
+	}
+
+	pa = noevict ? get_ppages(1) : alloc_upages(1);
+	if (pa != 0) {
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+		vm_stats.vs_zero_misses++;
+	}
+	return pa;
+}
+
+/*
+ * Called from cpu_idle with interrupts off: zero one free frame into
+ * the pool if it is short. Frames are only taken while there are more
+ * than vm_cleaner_lowat free, so the pool never adds memory pressure.
+ * Returns true if it did anything, so the caller checks its run queue
+ * again instead of sleeping.
+ */
+bool
+vm_idlezero(void)
+{
+	int index;
+
+	if (coremap == NULL) {
+		return false;
+	}
+	spinlock_acquire(&coremap_spinlock);
+	if (zeropool_count >= vm_zeropool_target ||
+	    (unsigned)bytes_left / PAGE_SIZE <= vm_cleaner_lowat + zeropool_count ||
+	    freelists[0] < 0) {
+		spinlock_release(&coremap_spinlock);
+		return false;
+	}
+	/* Order 0 only, so the pool does not break up larger blocks */
+	index = buddy_take(0, 0, 1);
+	coremap[index].blk_state = BLOCK_PARENT;
+	coremap[index].block_size = 1;
+	coremap[index].pg_state = PAGE_FIXED;
+	coremap[index].cm_refcount = 0;
+	spinlock_release(&coremap_spinlock);
+
+	/* Nobody else can see the frame now */
+	bzero((void *)PADDR_TO_KVADDR(coremap[index].pas), PAGE_SIZE);
+
+	spinlock_acquire(&coremap_spinlock);
+	coremap[index].cm_next = zeropool;
+	zeropool = index;
+	zeropool_count++;
+	vm_stats.vs_zeroed++;
+	spinlock_release(&coremap_spinlock);
+	return true;
+}
+
+/* Drop a reference to the user frame at INDEX. Caller holds the lock. */
+static
+void
+coremap_decref(int index)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[index].cm_refcount > 0);
+
+	if(--coremap[index].cm_refcount == 0){
+		free_pages(coremap[index].pas, index);
+	}
+}
+
+/* Record PTE as the only mapping of the frame it holds */
+static
+void
+coremap_claim(struct addrspace *as, vaddr_t vpn, pte_t *pte)
+{
+	int index;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	index = coremap_index(PTE_PADDR(*pte));
+	KASSERT(index >= 0);
+	KASSERT(coremap[index].cm_refcount == 1);
+	coremap[index].as = as;
+	coremap[index].cm_pte = pte;
+	coremap[index].cm_uvaddr = vpn;
+}
+
+/* Move USAGE's resident count by DELTA, keeping the high-water mark */
+static
+void
+usage_resident(struct vm_usage *usage, int delta)
+{
+	usage->vu_resident += delta;
+	if(usage->vu_resident > usage->vu_maxresident){
+		usage->vu_maxresident = usage->vu_resident;
+	}
+}
+
+void
+vm_getusage(struct addrspace *as, struct vm_usage *ret)
+{
+	spinlock_acquire(&coremap_spinlock);
+	*ret = as->as_usage;
+	spinlock_release(&coremap_spinlock);
+}
+
+void
+vm_pte_release(pte_t *ptes, unsigned n, struct vm_usage *usage)
+{
+	unsigned i;
+	int index;
+
+	spinlock_acquire(&coremap_spinlock);
+	for(i=0; i<n; i++){
+		if(ptes[i] == 0){
+			continue;
+		}
+		while(ptes[i] & PTE_BUSY){
+			wchan_sleep(coremap_wchan, &coremap_spinlock);
+		}
+		if(ptes[i] & PTE_WIRED){
+			coremap_nwired--;
+		}
+		if(ptes[i] & PTE_VALID){
+			index = coremap_index(PTE_PADDR(ptes[i]));
+			KASSERT(index >= 0);
+			if(coremap[index].cm_pte == &ptes[i]){
+				/* The cleaner may still hold the frame */
+				coremap[index].as = NULL;
+				coremap[index].cm_pte = NULL;
+			}
+			coremap_decref(index);
+			if(usage != NULL){
+				usage->vu_resident--;
+			}
+		}
+		else if(ptes[i] & PTE_SWAPPED){
+			swap_free(PTE_SLOT(ptes[i]));
+			if(usage != NULL){
+				usage->vu_swapped--;
+			}
+		}
+		ptes[i] = 0;
+	}
+	spinlock_release(&coremap_spinlock);
+}
+
+void
+vm_pte_share(pte_t *src, pte_t *dst, unsigned n, struct vm_usage *usage)
+{
+	unsigned i;
+	int index;
+
+	spinlock_acquire(&coremap_spinlock);
+	for(i=0; i<n; i++){
+		if(src[i] == 0){
+			continue;
+		}
+		while(src[i] & PTE_BUSY){
+			wchan_sleep(coremap_wchan, &coremap_spinlock);
+		}
+		if(src[i] & PTE_VALID){
+			index = coremap_index(PTE_PADDR(src[i]));
+			KASSERT(index >= 0);
+			if(src[i] & PTE_WRITE){
+				src[i] |= PTE_COW;
+			}
+			/* Shared frames have no single owner to evict from */
+			coremap[index].cm_refcount++;
+			coremap[index].as = NULL;
+			coremap[index].cm_pte = NULL;
+			if(usage != NULL){
+				usage_resident(usage, 1);
+			}
+		}
+		else if(src[i] & PTE_SWAPPED){
+			swap_incref(PTE_SLOT(src[i]));
+			if(usage != NULL){
+				usage->vu_swapped++;
+			}
+		}
+		/* Locks are not inherited */
+		dst[i] = src[i] & ~PTE_WIRED;
+	}
+	spinlock_release(&coremap_spinlock);
+}
+
+unsigned
+int
+coremap_used_bytes() {
+    size_t ramsize;
+    ramsize = mainbus_ramsize();
+    return ramsize - bytes_left;
+}
+
+/*
+ * Per-CPU TLB bookkeeping, indexed by c_number like cpustacks[]. Only
+ * the owning CPU touches its entry, and always with interrupts off.
+ *
+ * ts_slot[] shadows the TLB. A slot is FREE when invalid, NEW when
+ * loaded or updated since the hand last passed it, and OLD otherwise.
+ * Refills take the first FREE or OLD slot from the hand onwards,
+ * knocking NEW slots down to OLD as they go, so an entry that is still
+ * being faulted on survives a lap (not-recently-used).
+ *
+ * ts_asid is the address space whose entries the TLB holds (0 for
+ * none), so as_activate can skip the flush when it comes back.
+ */
+#define TLBSLOT_FREE	0
+#define TLBSLOT_OLD	1
+#define TLBSLOT_NEW	2
+
+struct tlbstate {
+	unsigned char ts_slot[NUM_TLB];
+	unsigned ts_hand;
+	unsigned ts_asid;
+	struct vm_cpustats ts_stats;
+};
+
+static struct tlbstate tlbstate[MAXCPUS];
+
+/* Next software ASID to hand out; 0 is never used */
+static unsigned next_asid = 1;
+static struct spinlock asid_spinlock = SPINLOCK_INITIALIZER;
+
+/* Pick a TLB slot for a new entry. Call at splhigh. */
+static
+int
+tlb_pick_victim(struct tlbstate *ts)
+{
+	unsigned i;
+
+	for (i=0; i < 2 * NUM_TLB; i++) {
+		unsigned slot = ts->ts_hand;
+
+		ts->ts_hand = (ts->ts_hand + 1) % NUM_TLB;
+		if (ts->ts_slot[slot] == TLBSLOT_FREE) {
+			return slot;
+		}
+		if (ts->ts_slot[slot] == TLBSLOT_OLD) {
+			ts->ts_stats.vc_tlbevicts++;
+			return slot;
+		}
+		ts->ts_slot[slot] = TLBSLOT_OLD;
+	}
+	panic("tlb_pick_victim: no slot after two laps\n");
+}
+
+/*
+ * Enter EHI/ELO in this CPU's TLB: over the existing entry for the
+ * page if there is one, otherwise in a slot from tlb_pick_victim.
+ * Call at splhigh.
+ */
+static
+void
+tlb_load(uint32_t ehi, uint32_t elo)
+{
+	struct tlbstate *ts;
+	int index;
+
+	ts = &tlbstate[curcpu->c_number];
+	index = tlb_probe(ehi, 0);
+	if (index >= 0) {
+		ts->ts_stats.vc_tlbupdates++;
+	}
+	else {
+		ts->ts_stats.vc_tlbmisses++;
+		index = tlb_pick_victim(ts);
+	}
+	tlb_write(ehi, elo, index);
+	ts->ts_slot[index] = TLBSLOT_NEW;
+}
+
+/*
+ * Invalidate this CPU's TLB, except with KEEPKVA for entries mapping
+ * the kernel virtual area: those are the same in every address space.
+ */
+static
+void
+tlb_flush(bool keepkva)
+{
+	struct tlbstate *ts;
+	uint32_t ehi, elo;
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	ts = &tlbstate[curcpu->c_number];
+	for (i=0; i<NUM_TLB; i++) {
+		if (keepkva) {
+			tlb_read(&ehi, &elo, i);
+			if ((elo & TLBLO_VALID) && ehi >= MIPS_KSEG2) {
+				continue;
+			}
+		}
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		ts->ts_slot[i] = TLBSLOT_FREE;
+	}
+	ts->ts_hand = 0;
+	splx(spl);
+}
+
+void
+vm_tlbflush(void)
+{
+	tlb_flush(true);
+}
+
+unsigned
+vm_newasid(void)
+{
+	unsigned asid;
+
+	spinlock_acquire(&asid_spinlock);
+	asid = next_asid++;
+	if (next_asid == 0) {
+		next_asid = 1;
+	}
+	spinlock_release(&asid_spinlock);
+	return asid;
+}
+
+void
+vm_tlbactivate(struct addrspace *as)
+{
+	struct tlbstate *ts;
+	int spl;
+
+	spl = splhigh();
+	ts = &tlbstate[curcpu->c_number];
+	if (ts->ts_asid == as->as_asid) {
+		ts->ts_stats.vc_flushes_skipped++;
+	}
+	else {
+		vm_tlbflush();
+		ts->ts_asid = as->as_asid;
+		ts->ts_stats.vc_flushes++;
+	}
+	as->as_cpumask |= 1U << curcpu->c_number;
+	splx(spl);
+}
+
+/*
+ * Drop every entry for a page in [START, END) from this CPU's TLB, in
+ * a single walk over the TLB however large the range is.
+ */
+static
+void
+tlb_invalidate_range(vaddr_t start, vaddr_t end)
+{
+	uint32_t ehi, elo;
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) && (ehi & TLBHI_VPAGE) >= start &&
+		    (ehi & TLBHI_VPAGE) < end) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			tlbstate[curcpu->c_number].ts_slot[i] = TLBSLOT_FREE;
+		}
+	}
+}
+
+void
+vm_tlbretire(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	int spl;
+
+	spl = splhigh();
+	as->as_asid = vm_newasid();
+	as->as_cpumask = 1U << curcpu->c_number;
+	tlb_invalidate_range(start, end);
+	tlbstate[curcpu->c_number].ts_asid = as->as_asid;
+	splx(spl);
+}
+
+/* Drop the pages named in TS from this CPU's TLB. Call at splhigh. */
+static
+void
+tlb_invalidate_pages(const struct tlbshootdown *ts)
+{
+	unsigned i;
+	int index;
+
+	if (ts->ts_npages > TLBSHOOTDOWN_PAGES) {
+		/* kva_purge relies on this taking kernel entries too */
+		tlb_flush(false);
+		return;
+	}
+	for (i=0; i<ts->ts_npages; i++) {
+		index = tlb_probe(ts->ts_vaddrs[i] & PAGE_FRAME, 0);
+		if (index >= 0) {
+			tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+			tlbstate[curcpu->c_number].ts_slot[index] = TLBSLOT_FREE;
+		}
+	}
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	tlb_invalidate_pages(ts);
+	V(ts->ts_done);
+}
+
+/*
+ * Other CPUs that may hold TLB entries for AS: the ones it has run on
+ * under its current ASID that have not loaded another one since. An
+ * unknown owner means every CPU.
+ */
+static
+uint32_t
+tlb_holders(struct addrspace *as)
+{
+	uint32_t mask;
+	unsigned i;
+
+	if (as == NULL) {
+		return ~(uint32_t)0;
+	}
+	mask = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		if ((as->as_cpumask & (1U << i)) &&
+		    tlbstate[i].ts_asid == as->as_asid) {
+			mask |= 1U << i;
+		}
+	}
+	return mask;
+}
+
+/*
+ * Remove NPAGES pages from this CPU's TLB and from those of the CPUs
+ * in CPUS, and wait until they are gone. However many pages there are,
+ * each CPU gets at most one IPI. Rounds are serialized, which keeps
+ * each CPU's shootdown queue from filling.
+ */
+static
+void
+vm_shootdown(uint32_t cpus, const vaddr_t *vas, unsigned npages)
+{
+	struct tlbshootdown ts;
+	unsigned i, n;
+	int spl;
+
+	ts.ts_npages = npages;
+	for (i=0; vas != NULL && i < npages && i < TLBSHOOTDOWN_PAGES; i++) {
+		ts.ts_vaddrs[i] = vas[i];
+	}
+	ts.ts_done = shootdown_sem;
+
+	cpus &= ~(1U << curcpu->c_number);
+	if (cpus == 0) {
+		spl = splhigh();
+		tlb_invalidate_pages(&ts);
+		splx(spl);
+		return;
+	}
+
+	lock_acquire(shootdown_lock);
+	/* Stay on this CPU until the others have been told */
+	spl = splhigh();
+	tlb_invalidate_pages(&ts);
+	n = ipi_tlbshootdown_mask(cpus, &ts);
+	splx(spl);
+	if (n > 0) {
+		vm_stats.vs_shootdowns++;
+		vm_stats.vs_shootdown_ipis += n;
+	}
+	while (n-- > 0) {
+		P(shootdown_sem);
+	}
+	lock_release(shootdown_lock);
+}
+
+/*
+ * Kernel virtual area: KVA_PAGES pages of kseg2 where multi-page
+ * kernel allocations are assembled from single frames once the buddy
+ * lists have no contiguous run left. kva_ptes[i] maps page i; the
+ * frame is in the top bits, like a PTE. Nothing else ever goes in
+ * kseg2, so its TLB entries are kept across address space switches.
+ *
+ * Freed pages turn KVA_STALE rather than free, because other CPUs may
+ * still hold them in their TLBs. When the area runs out, kva_purge
+ * takes them all back with a single flush on every CPU. The frames
+ * themselves are freed right away; only a use after free could reach
+ * them through a stale entry.
+ */
+#define KVA_PAGES	4096		/* 16M */
+#define KVA_MAPPED	0x1		/* Page is in use */
+#define KVA_LAST	0x2		/* Last page of its allocation */
+#define KVA_RESERVED	0x4		/* Being filled in by kva_alloc */
+#define KVA_STALE	0x8		/* Freed; may still be in a TLB */
+#define KVA_PURGING	0x10		/* Stale, and a flush is under way */
+
+static uint32_t kva_ptes[KVA_PAGES];
+static struct spinlock kva_spinlock = SPINLOCK_INITIALIZER;
+static unsigned kva_hint;		/* where the next search starts */
+static unsigned kva_nmapped, kva_nstale, kva_purges;
+
+/*
+ * First run of NPAGES free pages at or after kva_hint, wrapping
+ * around, or -1. Caller holds kva_spinlock.
+ */
+static
+int
+kva_findrun(unsigned npages)
+{
+	unsigned i, start, run, n;
+
+	start = kva_hint;
+	run = 0;
+	for (n=0; n < KVA_PAGES + npages; n++) {
+		i = (kva_hint + n) % KVA_PAGES;
+		if (i == 0) {
+			/* Runs don't wrap */
+			run = 0;
+		}
+		if (kva_ptes[i] != 0) {
+			run = 0;
+			continue;
+		}
+		if (run == 0) {
+			start = i;
+		}
+		if (++run == npages) {
+			return start;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Reclaim every stale page: mark them, flush all TLBs, and free the
+ * ones marked. Pages freed while the flush is going on wait for the
+ * next purge.
+ */
+static
+void
+kva_purge(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&kva_spinlock);
+	for (i=0; i<KVA_PAGES; i++) {
+		if (kva_ptes[i] == KVA_STALE) {
+			kva_ptes[i] = KVA_PURGING;
+		}
+	}
+	spinlock_release(&kva_spinlock);
+
+	vm_shootdown(~(uint32_t)0, NULL, TLBSHOOTDOWN_PAGES + 1);
+
+	spinlock_acquire(&kva_spinlock);
+	for (i=0; i<KVA_PAGES; i++) {
+		if (kva_ptes[i] == KVA_PURGING) {
+			kva_ptes[i] = 0;
+			kva_nstale--;
+		}
+	}
+	kva_purges++;
+	spinlock_release(&kva_spinlock);
+}
+
+static
+vaddr_t
+kva_alloc(unsigned npages)
+{
+	paddr_t pa;
+	unsigned i, got;
+	int start;
+
+	if (npages > KVA_PAGES) {
+		return 0;
+	}
+
+	spinlock_acquire(&kva_spinlock);
+	start = kva_findrun(npages);
+	if (start < 0 && kva_nstale > 0 && vm_cansleep()) {
+		spinlock_release(&kva_spinlock);
+		kva_purge();
+		spinlock_acquire(&kva_spinlock);
+		start = kva_findrun(npages);
+	}
+	if (start < 0) {
+		spinlock_release(&kva_spinlock);
+		return 0;
+	}
+	for (i=0; i<npages; i++) {
+		kva_ptes[start + i] = KVA_RESERVED;
+	}
+	kva_hint = (start + npages) % KVA_PAGES;
+	spinlock_release(&kva_spinlock);
+
+	/* Nobody else touches reserved pages, so fill them unlocked */
+	for (got=0; got<npages; got++) {
+		pa = get_ppages_evict(1);
+		if (pa == 0) {
+			break;
+		}
+		kva_ptes[start + got] = pa | KVA_RESERVED;
+	}
+
+	if (got < npages) {
+		/* Never mapped, so no TLB can have them */
+		for (i=0; i<got; i++) {
+			free_kpages(PADDR_TO_KVADDR(kva_ptes[start + i] &
+						    PAGE_FRAME));
+		}
+		spinlock_acquire(&kva_spinlock);
+		for (i=0; i<npages; i++) {
+			kva_ptes[start + i] = 0;
+		}
+		spinlock_release(&kva_spinlock);
+		return 0;
+	}
+
+	spinlock_acquire(&kva_spinlock);
+	for (i=0; i<npages; i++) {
+		kva_ptes[start + i] = (kva_ptes[start + i] & PAGE_FRAME) |
+			KVA_MAPPED;
+	}
+	kva_ptes[start + npages - 1] |= KVA_LAST;
+	kva_nmapped += npages;
+	spinlock_release(&kva_spinlock);
+
+	return MIPS_KSEG2 + (vaddr_t)start * PAGE_SIZE;
+}
+
+static
+void
+kva_free(vaddr_t va)
+{
+	paddr_t frames[TLBSHOOTDOWN_PAGES];
+	unsigned i, first, n;
+	uint32_t pte;
+	bool last;
+	int spl;
+
+	KASSERT(va % PAGE_SIZE == 0);
+	first = (va - MIPS_KSEG2) / PAGE_SIZE;
+	KASSERT(first < KVA_PAGES);
+
+	/* A batch of frames per lock hold; free them with the lock dropped */
+	i = first;
+	do {
+		spinlock_acquire(&kva_spinlock);
+		for (n=0, last=false; n < TLBSHOOTDOWN_PAGES && !last; n++) {
+			KASSERT(i + n < KVA_PAGES);
+			pte = kva_ptes[i + n];
+			KASSERT(pte & KVA_MAPPED);
+			frames[n] = pte & PAGE_FRAME;
+			last = (pte & KVA_LAST) != 0;
+			kva_ptes[i + n] = KVA_STALE;
+		}
+		kva_nmapped -= n;
+		kva_nstale += n;
+		spinlock_release(&kva_spinlock);
+
+		spl = splhigh();
+		tlb_invalidate_range(MIPS_KSEG2 + i * PAGE_SIZE,
+				     MIPS_KSEG2 + (i + n) * PAGE_SIZE);
+		splx(spl);
+
+		while (n > 0) {
+			free_kpages(PADDR_TO_KVADDR(frames[--n]));
+			i++;
+		}
+	} while (!last);
+}
+
+/*
+ * TLB miss on the kernel virtual area. Only called for pages that are
+ * in use; anything else is a kernel bug and gets EFAULT, hence a panic.
+ */
+static
+int
+kva_fault(vaddr_t va)
+{
+	unsigned index;
+	uint32_t pte;
+	int spl;
+
+	index = (va - MIPS_KSEG2) / PAGE_SIZE;
+	if (index >= KVA_PAGES) {
+		return EFAULT;
+	}
+	pte = kva_ptes[index];
+	if ((pte & KVA_MAPPED) == 0) {
+		return EFAULT;
+	}
+
+	spl = splhigh();
+	tlb_load(va & PAGE_FRAME, (pte & PAGE_FRAME) | TLBLO_DIRTY | TLBLO_VALID);
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Second-chance clock over the coremap: skip frames we cannot evict,
+ * and give referenced ones another lap with the bit cleared. With
+ * CLEANONLY, only frames that already have a copy in swap will do.
+ */
+static
+int
+clock_pick(bool cleanonly)
+{
+	int i, index;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i < 2 * NUM_ENTRIES; i++) {
+		index = clock_hand;
+		clock_hand = (clock_hand + 1) % NUM_ENTRIES;
+		if (coremap[index].cm_pte == NULL || coremap[index].cm_busy ||
+		    coremap[index].cm_refcount != 1 ||
+		    (*(pte_t *)coremap[index].cm_pte & PTE_WIRED) ||
+		    (cleanonly && coremap[index].cm_slot < 0)) {
+			continue;
+		}
+		if (coremap[index].cm_referenced) {
+			coremap[index].cm_referenced = false;
+			continue;
+		}
+		return index;
+	}
+	return -1;
+}
+
+/*
+ * Push one user page out to swap and hand its frame to the caller,
+ * still allocated with a single reference. A clean page just gives
+ * its frame up; a dirty one has to be written first. Returns 0 if
+ * there is no swap, no room in it, or nothing we can evict.
+ */
+static
+paddr_t
+vm_evict(void)
+{
+	unsigned slot;
+	int index, result;
+	bool dirty;
+	uint32_t cpus;
+	pte_t *pte;
+	pte_t old;
+	vaddr_t va;
+	paddr_t pa;
+	struct addrspace *owner;
+
+	if (!swap_enabled()) {
+		return 0;
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	index = clock_pick(false);
+	if (index >= 0 && coremap[index].cm_slot < 0 && swap_alloc(&slot)) {
+		/* Swap is full; only clean pages can go */
+		index = clock_pick(true);
+	}
+	if (index < 0) {
+		spinlock_release(&coremap_spinlock);
+		return 0;
+	}
+	dirty = coremap[index].cm_slot < 0;
+	if (!dirty) {
+		/* The slot reference moves from the frame to the PTE */
+		slot = coremap[index].cm_slot;
+		coremap[index].cm_slot = -1;
+		coremap_nclean--;
+	}
+	else {
+		vm_stats.vs_fault_stalls++;
+	}
+	coremap[index].cm_busy = true;
+	pte = (pte_t *)coremap[index].cm_pte;
+	va = coremap[index].cm_uvaddr;
+	pa = coremap[index].pas;
+	/* Can't go away while the page is busy; see vm_pte_release */
+	owner = coremap[index].as;
+	cpus = tlb_holders(owner);
+	old = *pte;
+	KASSERT(old & PTE_VALID);
+	KASSERT(PTE_PADDR(old) == pa);
+	*pte = (old & ~PTE_VALID) | PTE_BUSY;
+	spinlock_release(&coremap_spinlock);
+
+	/* Nobody can reach the page now except through a stale TLB entry */
+	vm_shootdown(cpus, &va, 1);
+	result = dirty ? swap_out(slot, pa) : 0;
+
+	spinlock_acquire(&coremap_spinlock);
+	coremap[index].cm_busy = false;
+	if (result) {
+		*pte = old;
+		swap_free(slot);
+	}
+	else {
+		/* The frame was private, so the page no longer needs COW */
+		*pte = PTE_MKSLOT(slot) | (old & PTE_PERMS) | PTE_SWAPPED;
+		coremap[index].as = NULL;
+		coremap[index].cm_pte = NULL;
+		coremap[index].cm_uvaddr = 0;
+		coremap[index].cm_referenced = false;
+		vm_stats.vs_evictions++;
+		owner->as_usage.vu_resident--;
+		owner->as_usage.vu_swapped++;
+		owner->as_usage.vu_evicted++;
+	}
+	wchan_wakeall(coremap_wchan, &coremap_spinlock);
+	spinlock_release(&coremap_spinlock);
+
+	return result ? 0 : pa;
 }
 
-/* We need to make alloc_upages and free_upages functions */
+/* Most pages the cleaner takes on at once; one shootdown covers them */
+#define CLEANER_MAXBATCH TLBSHOOTDOWN_PAGES
 
-/* Allocate/free some kernel-space virtual pages */
-paddr_t
-get_ppages(unsigned npages){
-	
-	paddr_t pa;
-	// Critical section. Protect the coremap
-	spinlock_acquire(&coremap_spinlock);
-	
-	if((int)(npages*PAGE_SIZE) > bytes_left || npages==0){
-        	pa = 0;
-		spinlock_release(&coremap_spinlock);
-        	return pa;
-	}
-	for(int i=0; i<NUM_ENTRIES; i++) {
-		if(coremap[i].pg_state == PAGE_FREE && coremap[i].use_state == REUSE){
-		unsigned cont;
-		for(cont = 0; cont<npages; cont++){
-			if(coremap[i+cont].pg_state != PAGE_FREE || coremap[i+cont].use_state != REUSE){
-			i+=cont;
+/*
+ * Write a batch of dirty frames to fresh swap slots so that they can
+ * later be evicted without I/O. The pages stay mapped throughout: we
+ * hold an extra reference so each frame cannot go away, and write-
+ * protect them first (one shootdown for the lot) so that a store
+ * during the write shows up as PTE_DIRTY again. Picks the frames just
+ * ahead of the clock hand that the clock would take next. Called with
+ * coremap_spinlock, which is dropped meanwhile. Returns the number of
+ * pages tried.
+ */
+static
+unsigned
+vm_clean_batch(void)
+{
+	int indexes[CLEANER_MAXBATCH];
+	pte_t *ptes[CLEANER_MAXBATCH];
+	vaddr_t vas[CLEANER_MAXBATCH];
+	unsigned slots[CLEANER_MAXBATCH];
+	unsigned batch, n, k;
+	uint32_t cpus;
+	int i, index, result;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	batch = vm_cleaner_batch < CLEANER_MAXBATCH ?
+		vm_cleaner_batch : CLEANER_MAXBATCH;
+	cpus = 0;
+	n = 0;
+	for (i=0; i < NUM_ENTRIES && n < batch; i++) {
+		index = (clock_hand + i) % NUM_ENTRIES;
+		if (coremap[index].cm_pte == NULL ||
+		    coremap[index].cm_busy ||
+		    coremap[index].cm_refcount != 1 ||
+		    coremap[index].cm_referenced ||
+		    coremap[index].cm_slot >= 0 ||
+		    (*(pte_t *)coremap[index].cm_pte & PTE_WIRED)) {
+			continue;
+		}
+		if (swap_alloc(&slots[n])) {
 			break;
-			}
 		}
-		if(cont==npages){
-			pa = coremap[i].pas;
-			for(unsigned n=0; n<npages; n++){
-				if(n==0){
-					coremap[i+n].blk_state = BLOCK_PARENT;
-				}
-				else{
-					coremap[i+n].blk_state = BLOCK_CHILD;
-				}
-				coremap[i+n].block_size = npages;
-				coremap[i+n].pg_state = PAGE_FIXED;
-				coremap[i+n].use_state = REUSE;
-				}
-			// Update bytes_left
-			bytes_left -= (npages*PAGE_SIZE);
-			spinlock_release(&coremap_spinlock);
-			return pa;
+		coremap[index].cm_refcount++;
+		indexes[n] = index;
+		ptes[n] = (pte_t *)coremap[index].cm_pte;
+		vas[n] = coremap[index].cm_uvaddr;
+		*ptes[n] &= ~PTE_DIRTY;
+		cpus |= tlb_holders(coremap[index].as);
+		n++;
+	}
+	if (n == 0) {
+		return 0;
+	}
+	spinlock_release(&coremap_spinlock);
+
+	vm_shootdown(cpus, vas, n);
+
+	for (k=0; k<n; k++) {
+		index = indexes[k];
+		result = swap_out(slots[k], coremap[index].pas);
+
+		spinlock_acquire(&coremap_spinlock);
+		if (result == 0 && coremap[index].cm_pte == ptes[k] &&
+		    !(*ptes[k] & PTE_DIRTY)) {
+			coremap[index].cm_slot = slots[k];
+			coremap_nclean++;
+			vm_stats.vs_cleaned++;
+		}
+		else {
+			swap_free(slots[k]);
+			if (coremap[index].cm_pte == ptes[k]) {
+				*ptes[k] |= PTE_DIRTY;
 			}
 		}
+		coremap_decref(index);
+		spinlock_release(&coremap_spinlock);
 	}
-	pa = 0;
-	spinlock_release(&coremap_spinlock);
-	return pa;
 
+	spinlock_acquire(&coremap_spinlock);
+	return n;
 }
 
-vaddr_t
-alloc_kpages(unsigned npages)
+/*
+ * The page cleaner thread. Each time it is prodded it cleans batches
+ * of up to vm_cleaner_batch pages until enough frames are free or
+ * clean, then goes back to sleep.
+ */
+static
+void
+vm_cleaner(void *data1, unsigned long data2)
 {
-	paddr_t pa;
-	pa = get_ppages(npages);
-	if(pa== 0){
-		return pa;
-	}
-	return PADDR_TO_KVADDR(pa);
-}
+	unsigned n;
 
-paddr_t 
-alloc_upages(unsigned npages){
-	paddr_t pa = get_ppages(npages);	
-	return pa;
-}
+	(void)data1;
+	(void)data2;
 
-void free_pages(unsigned int addr, int index){	
-//	spinlock_acquire(&coremap_spinlock);
-	int n = coremap[index].block_size;
-	int npages = coremap[index].block_size;
-	while(n>0){
-		coremap[index].as = NULL;
-		coremap[index].block_size = 0;
-		coremap[index].pg_state = PAGE_FREE;
-		coremap[index].blk_state = BLOCK_CHILD;
-		n--;
-		index++;
-	}
-	if(n==0){
-		bytes_left += (npages*PAGE_SIZE);
+	spinlock_acquire(&coremap_spinlock);
+	while (1) {
+		cleaner_idle = true;
+		wchan_sleep(cleaner_wchan, &coremap_spinlock);
+
+		do {
+			n = vm_clean_batch();
+		} while (n > 0 && (unsigned)bytes_left / PAGE_SIZE +
+			 coremap_nclean < vm_cleaner_lowat);
 	}
-//	spinlock_release(&coremap_spinlock);
-	(void)addr;
 }
 
 void
-free_kpages(vaddr_t addr)
+vm_printstats(void)
 {
+	int i;
 
-	// Critical section. Protect the coremap
 	spinlock_acquire(&coremap_spinlock);
-   
-	//NEW STUFF
-	int index = 0;
-	for(; index<NUM_ENTRIES; index++){
-		if(addr == coremap[index].vas){
-			if(coremap[index].blk_state == BLOCK_CHILD || 
-				coremap[index].use_state == NO_REUSE){
-        			break;
-			}
+	kprintf("vm: %u free, %u clean; cleaner low-water %u, batch %u\n",
+		(unsigned)bytes_left / PAGE_SIZE, coremap_nclean,
+		vm_cleaner_lowat, vm_cleaner_batch);
+	kprintf("vm: %u pages wired, at most %u\n", coremap_nwired, VM_MAXWIRED);
+	kprintf("vm: %u evictions (%u had to write), %u swapins\n",
+		vm_stats.vs_evictions, vm_stats.vs_fault_stalls,
+		vm_stats.vs_swapins);
+	kprintf("vm: cleaner woken %u times, %u pages cleaned\n",
+		vm_stats.vs_cleaner_wakeups, vm_stats.vs_cleaned);
+	kprintf("vm: %u shootdown rounds, %u IPIs\n",
+		vm_stats.vs_shootdowns, vm_stats.vs_shootdown_ipis);
+	kprintf("vm: zero pool %u of %u; %u zeroed when idle, "
+		"%u fills from the pool, %u zeroed on demand\n",
+		zeropool_count, vm_zeropool_target, vm_stats.vs_zeroed,
+		vm_stats.vs_zero_hits, vm_stats.vs_zero_misses);
+	kprintf("vm: fault-around up to %u: %u pages in, %u tlb preloads\n",
+		vm_faultaround_max, vm_stats.vs_faultaround,
+		vm_stats.vs_faultaround_tlb);
+	spinlock_release(&coremap_spinlock);
+
+	spinlock_acquire(&kva_spinlock);
+	kprintf("vm: kernel virtual area %u of %u pages in use, "
+		"%u awaiting purge, %u purges\n",
+		kva_nmapped, KVA_PAGES, kva_nstale, kva_purges);
+	spinlock_release(&kva_spinlock);
 
-			free_pages(addr,index);
+	/* Racy against the other CPUs, but these are only counters */
+	for (i=0; i<MAXCPUS; i++) {
+		struct vm_cpustats *vc = &tlbstate[i].ts_stats;
+
+		if (vc->vc_tlbmisses + vc->vc_tlbupdates +
+		    vc->vc_flushes + vc->vc_flushes_skipped == 0) {
+			continue;
 		}
+		kprintf("cpu%d: %u page faults, %u tlb misses, "
+			"%u in-place updates, %u live entries replaced\n", i,
+			vc->vc_pagefaults, vc->vc_tlbmisses, vc->vc_tlbupdates,
+			vc->vc_tlbevicts);
+		kprintf("cpu%d: %u context switch flushes, %u skipped\n", i,
+			vc->vc_flushes, vc->vc_flushes_skipped);
 	}
-	spinlock_release(&coremap_spinlock);
-	(void)addr;
 }
 
-void
-free_upages(paddr_t addr)
+int valid_address(vaddr_t faultaddress, struct addrspace *as, struct region **ret){
+	struct region *region;
+
+	region = as_region_lookup(as, faultaddress);
+	if(region == NULL){
+		/* If it gets here, it's not valid*/
+		return EFAULT;
+	}
+	*ret = region;
+	return 0;
+}
+
+
+/*
+ * Fill the freshly zeroed frame PA for page VPN with whatever part of
+ * REGION's file backing falls on that page.
+ */
+static
+int
+vm_pagein_file(struct region *region, vaddr_t vpn, paddr_t pa)
 {
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	if(region->vnode == NULL){
+		return 0;
+	}
+	start = vpn > region->file_vaddr ? vpn : region->file_vaddr;
+	end = region->file_vaddr + region->filesize;
+	if(end > vpn + PAGE_SIZE){
+		end = vpn + PAGE_SIZE;
+	}
+	if(start >= end){
+		/* Page is entirely zero-fill */
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(pa) + (start - vpn)),
+		  end - start, region->file_offset + (start - region->file_vaddr),
+		  UIO_READ);
+	result = VOP_READ(region->vnode, &ku);
+	if(result){
+		return result;
+	}
+	if(ku.uio_resid != 0){
+		/* File was truncated under the mapping */
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+/* True if paging in VPN means reading part of REGION's file */
+static
+bool
+vm_pagein_reads(struct region *region, vaddr_t vpn)
+{
+	return region->vnode != NULL &&
+		vpn < region->file_vaddr + region->filesize &&
+		region->file_vaddr < vpn + PAGE_SIZE;
+}
+
+/*
+ * Bring in the page for VPN: from swap if it was paged out, otherwise
+ * zero-filled plus whatever the region's file has for it. Called and
+ * returns with coremap_spinlock held, but drops it in between; the PTE
+ * is marked busy meanwhile so nobody else touches it. AHEAD pages are
+ * for fault-around and only take free frames, never evicting for one.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct region *region, vaddr_t vpn,
+	  pte_t *pte, bool ahead)
+{
+	pte_t old;
+	paddr_t pa;
+	int err;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	old = *pte;
+	KASSERT(!(old & (PTE_VALID | PTE_BUSY)));
+	*pte = old | PTE_BUSY;
+	if(!ahead){
+		tlbstate[curcpu->c_number].ts_stats.vc_pagefaults++;
+	}
+	spinlock_release(&coremap_spinlock);
+
+	if(old & PTE_SWAPPED){
+		/* About to be overwritten, so any frame will do */
+		pa = ahead ? get_ppages(1) : alloc_upages(1);
+		err = pa == 0 ? ENOMEM : swap_in(PTE_SLOT(old), pa);
+	}
+	else{
+		pa = alloc_upage_zeroed(ahead);
+		/* Executable pages are read from the file on first touch */
+		err = pa == 0 ? ENOMEM : vm_pagein_file(region, vpn, pa);
+	}
 
-	// Critical section. Protect the coremap
 	spinlock_acquire(&coremap_spinlock);
-   
-	//NEW STUFF
-	int index = 0;
-	for(; index<NUM_ENTRIES; index++){
-		if(addr == coremap[index].pas){
-			if(coremap[index].blk_state == BLOCK_CHILD || 
-				coremap[index].use_state == NO_REUSE){
-        			break;
-			}
-			free_pages(addr,index);
+	if(err){
+		if(pa != 0){
+			coremap_decref(coremap_index(pa));
 		}
+		*pte = old;
 	}
-	spinlock_release(&coremap_spinlock);
-	(void)addr;
+	else{
+		if(old & PTE_SWAPPED){
+			/*
+			 * Our copy is private now, even if the slot was
+			 * shared. It stays clean until written, so the
+			 * frame keeps the PTE's reference to the slot.
+			 */
+			*pte = pa | (old & PTE_PERMS) | PTE_VALID;
+			coremap_claim(as, vpn, pte);
+			coremap[coremap_index(pa)].cm_slot = PTE_SLOT(old);
+			coremap_nclean++;
+			vm_stats.vs_swapins++;
+			as->as_usage.vu_swapped--;
+		}
+		else{
+			/* Nothing in swap to fall back on */
+			*pte = pa | (region->permissions & PTE_PERMS) |
+				PTE_VALID | PTE_DIRTY;
+			coremap_claim(as, vpn, pte);
+		}
+		usage_resident(&as->as_usage, 1);
+		if(ahead){
+			/* Not a fault as far as anyone can tell */
+		}
+		else if((old & PTE_SWAPPED) || vm_pagein_reads(region, vpn)){
+			as->as_usage.vu_majflt++;
+		}
+		else{
+			as->as_usage.vu_minflt++;
+		}
+	}
+	wchan_wakeall(coremap_wchan, &coremap_spinlock);
+	return err;
 }
 
+/*
+ * Resolve a write to a PTE_COW page: copy the frame if it is still
+ * shared, then clear PTE_COW. Same locking as vm_pagein.
+ */
+static
+int
+vm_cow_break(struct addrspace *as, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+	int index;
 
-unsigned
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(*pte & PTE_VALID);
+	KASSERT(*pte & PTE_COW);
+
+	oldpa = PTE_PADDR(*pte);
+	index = coremap_index(oldpa);
+	KASSERT(index >= 0);
+	if(coremap[index].cm_refcount > 1){
+		/*
+		 * We hold a reference and the frame has no owner, so it
+		 * cannot be paged out or freed while we copy it.
+		 */
+		*pte |= PTE_BUSY;
+		spinlock_release(&coremap_spinlock);
+		newpa = alloc_upages(1);
+		if(newpa != 0){
+			memmove((void*)PADDR_TO_KVADDR(newpa),
+				(const void*)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+		}
+		spinlock_acquire(&coremap_spinlock);
+		*pte &= ~PTE_BUSY;
+		wchan_wakeall(coremap_wchan, &coremap_spinlock);
+		if(newpa == 0){
+			return ENOMEM;
+		}
+		coremap_decref(index);
+		*pte = newpa | (*pte & ~PTE_FRAME) | PTE_DIRTY;
+		as->as_usage.vu_cowbreaks++;
+	}
+	*pte &= ~PTE_COW;
+	return 0;
+}
+
+/*
+ * Get the page for VPN resident and settled. It can be paged out again
+ * whenever we let go of the lock, hence the loop. Called and returns
+ * with coremap_spinlock held.
+ */
+static
 int
-coremap_used_bytes() {
-    size_t ramsize;
-    ramsize = mainbus_ramsize();
-    return ramsize - bytes_left;
+vm_makeresident(struct addrspace *as, struct region *region, vaddr_t vpn,
+		pte_t *pte)
+{
+	int err;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	while(!(*pte & PTE_VALID) || (*pte & PTE_BUSY)){
+		if(*pte & PTE_BUSY){
+			wchan_sleep(coremap_wchan, &coremap_spinlock);
+			continue;
+		}
+		err = vm_pagein(as, region, vpn, pte, false);
+		if(err){
+			return err;
+		}
+	}
+	return 0;
 }
 
+/* Caller holds coremap_spinlock */
+static
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+vm_unwire_pte(pte_t *pte)
 {
-	(void)ts;
-	/* Implement */
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	if(*pte & PTE_WIRED){
+		*pte &= ~PTE_WIRED;
+		coremap_nwired--;
+	}
 }
 
-/* Acts as a boolean */
-bool region_check(vaddr_t faultaddress, struct region *region){
-	struct region *temp;
-	temp = region;
-	while(temp != NULL){
-		/* is the address within range */
-		if(faultaddress >= temp->as_vbase && faultaddress < temp->as_vend){
-			return true;
+/*
+ * With WIRE, NEWLYWIRED records the pages this call wired itself, so
+ * that a failure can unwire exactly those and leave pages locked by
+ * an earlier mlock alone.
+ */
+int
+vm_populate(struct addrspace *as, vaddr_t start, vaddr_t end, bool wire)
+{
+	struct region *region;
+	struct bitmap *newlywired = NULL;
+	vaddr_t va;
+	pte_t *pte;
+	unsigned i;
+	int err = 0;
+
+	start &= PAGE_FRAME;
+	if(wire){
+		newlywired = bitmap_create(DIVROUNDUP(end - start, PAGE_SIZE));
+		if(newlywired == NULL){
+			return ENOMEM;
+		}
+	}
+
+	for(va = start, i = 0; va < end; va += PAGE_SIZE, i++){
+		region = as_region_lookup(as, va);
+		if(region == NULL){
+			err = ENOMEM;
+			break;
+		}
+		pte = pagetable_lookup(as->page_table, va, true);
+		if(pte == NULL){
+			err = ENOMEM;
+			break;
+		}
+		spinlock_acquire(&coremap_spinlock);
+		err = vm_makeresident(as, region, va, pte);
+		if(!err && wire && !(*pte & PTE_WIRED)){
+			if(coremap_nwired >= VM_MAXWIRED){
+				err = EAGAIN;
+			}
+			else{
+				*pte |= PTE_WIRED;
+				coremap_nwired++;
+				bitmap_mark(newlywired, i);
+			}
+		}
+		spinlock_release(&coremap_spinlock);
+		if(err){
+			break;
+		}
+	}
+
+	if(err && wire){
+		/* Everything marked is below va, so its table exists */
+		end = va;
+		for(va = start, i = 0; va < end; va += PAGE_SIZE, i++){
+			if(!bitmap_isset(newlywired, i)){
+				continue;
+			}
+			pte = pagetable_lookup(as->page_table, va, false);
+			KASSERT(pte != NULL);
+			spinlock_acquire(&coremap_spinlock);
+			vm_unwire_pte(pte);
+			spinlock_release(&coremap_spinlock);
 		}
-		temp = temp->next;
 	}
-	temp = NULL;
-	return false;
+	if(newlywired != NULL){
+		bitmap_destroy(newlywired);
+	}
+	return err;
 }
 
+void
+vm_unwire(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *pte;
 
-int valid_address(vaddr_t faultaddress, struct addrspace *as){
-	/* Checks it falls in code and text addr */
-	bool valid = false;
-	valid = region_check(faultaddress, as->region_table);
-	if(!valid){
-		/* If not in code or text check the stack */
-		valid = region_check(faultaddress, as->stack_region);
-		if(!valid){
-			/* If not in stack, check the heap */
-			valid = region_check(faultaddress, as->heap_region);
-			/* If it gets here, it's not valid*/
-			if(!valid){
-				return EFAULT;	
+	for(va = start & PAGE_FRAME; va < end; va += PAGE_SIZE){
+		pte = pagetable_lookup(as->page_table, va, false);
+		if(pte == NULL){
+			/* Skip the rest of this second-level table */
+			va |= (PT_ENTRIES - 1) * PAGE_SIZE;
+			if(va + PAGE_SIZE < va){
+				break;
 			}
-			return 0;
+			continue;
 		}
-		return 0;
+		spinlock_acquire(&coremap_spinlock);
+		vm_unwire_pte(pte);
+		spinlock_release(&coremap_spinlock);
+	}
+}
+
+int
+vm_discard(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *pte;
+	bool wired = false;
+
+	start &= PAGE_FRAME;
+	spinlock_acquire(&coremap_spinlock);
+	for(va = start; va < end && !wired; va += PAGE_SIZE){
+		pte = pagetable_lookup(as->page_table, va, false);
+		wired = pte != NULL && (*pte & PTE_WIRED);
+	}
+	spinlock_release(&coremap_spinlock);
+	if(wired){
+		return EINVAL;
 	}
+
+	/* Frames and swap slots go straight back; nothing is written */
+	vm_tlbretire(as, start, end);
+	pagetable_unmap_range(as->page_table, start, end, &as->as_usage);
 	return 0;
 }
 
+void
+vm_mincore(struct addrspace *as, vaddr_t start, vaddr_t end,
+	   unsigned char *vec)
+{
+	vaddr_t va;
+	pte_t *pte;
+	unsigned i;
 
-struct page_entry * vpn_check(vaddr_t vpn, struct page_entry *pt){
-	struct page_entry *temp;
-	temp = pt;
-	while(temp != NULL){
-		/* is the address within range */
-		if(temp->vpn == vpn){
-			return temp;
-		}
-		temp = temp->next;
+	spinlock_acquire(&coremap_spinlock);
+	for(i = 0, va = start & PAGE_FRAME; va < end; i++, va += PAGE_SIZE){
+		pte = pagetable_lookup(as->page_table, va, false);
+		vec[i] = pte != NULL && (*pte & PTE_VALID) &&
+			!(*pte & PTE_BUSY);
+	}
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * TLBLO for a resident PTE. Only hand out a writable entry once the
+ * page is dirty, so the first store to a clean page faults and we can
+ * let go of its copy in swap.
+ */
+static
+uint32_t
+pte_tlblo(pte_t pte)
+{
+	uint32_t elo;
+
+	elo = PTE_PADDR(pte) | TLBLO_VALID;
+	if((pte & PTE_WRITE) && !(pte & PTE_COW) && (pte & PTE_DIRTY)){
+		elo |= TLBLO_DIRTY;
+	}
+	return elo;
+}
+
+/*
+ * Feed the fault at VPN to REGION's sequential detector and return
+ * how many pages after it to map.
+ */
+static
+unsigned
+faultaround_window(struct region *region, vaddr_t vpn)
+{
+	if(region->region_advice == MADV_SEQUENTIAL){
+		/* Told to expect it, so don't bother ramping up */
+		region->ra_window = vm_faultaround_max;
+		return region->ra_window;
+	}
+	if(vm_faultaround_max == 0 || vpn != region->ra_next ||
+	   region->region_advice == MADV_RANDOM){
+		region->ra_window = 0;
+	}
+	else if(region->ra_window == 0){
+		region->ra_window = 1;
+	}
+	else if(region->ra_window < vm_faultaround_max){
+		region->ra_window *= 2;
+	}
+	if(region->ra_window > vm_faultaround_max){
+		region->ra_window = vm_faultaround_max;
 	}
-	temp = NULL;
-	return temp;
+	return region->ra_window;
 }
 
+/*
+ * Map up to NPAGES pages after VPN in REGION: untouched pages are
+ * zero-filled or read from the file, and those and any that are
+ * already resident go into the TLB. File-backed pages are read
+ * synchronously, one VOP_READ each, so the fault can wait on up to
+ * NPAGES reads; the window (ra_window, at most vm_faultaround_max)
+ * only grows while faults stay sequential. Stops at the first page
+ * that would need swap I/O, a new second-level table or an eviction.
+ * Called with coremap_spinlock held.
+ */
+static
+void
+vm_faultaround(struct addrspace *as, struct region *region, vaddr_t vpn,
+	       unsigned npages)
+{
+	vaddr_t va;
+	pte_t *pte;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for(i = 1; i <= npages; i++){
+		va = vpn + i * PAGE_SIZE;
+		if(va < vpn || va >= region->as_vend){
+			break;
+		}
+		/* Second-level tables can't be made under a spinlock */
+		pte = pagetable_lookup(as->page_table, va, false);
+		if(pte == NULL || (*pte & (PTE_BUSY | PTE_SWAPPED))){
+			break;
+		}
+		if(!(*pte & PTE_VALID)){
+			if((unsigned)bytes_left / PAGE_SIZE <= vm_cleaner_lowat){
+				break;
+			}
+			if(vm_pagein(as, region, va, pte, true)){
+				break;
+			}
+			vm_stats.vs_faultaround++;
+		}
+		tlb_load(va, pte_tlblo(*pte));
+		vm_stats.vs_faultaround_tlb++;
+	}
+	region->ra_next = vpn + i * PAGE_SIZE;
+}
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress){
-	(void)faulttype;
 	int err;
+	struct region *region;
 	
+	if (faultaddress >= MIPS_KSEG2) {
+		return kva_fault(faultaddress);
+	}
+
 	if (curproc == NULL) {
 		/*
 		 * No process. This is probably a kernel fault early
@@ -245,55 +1932,99 @@ vm_fault(int faulttype, vaddr_t faultaddress){
 		 */
 		return EFAULT;
 	}
-	//uint32_t fault = PAGE_FRAME;
 	
-	err = valid_address(faultaddress, as);
+	err = valid_address(faultaddress, as, &region);
 	if(err){
-		return err; //check valid_addr return value
+		/* Maybe the stack just needs to grow */
+		err = as_grow_stack(as, faultaddress);
+		if(err){
+			return err;
+		}
+		region = as->stack_region;
+	}
+	if((region->permissions & PTE_PERMS) == 0){
+		/* PROT_NONE mapping */
+		return EFAULT;
+	}
+	if(faulttype == VM_FAULT_WRITE && !(region->permissions & PTE_WRITE)){
+		/* Don't bother paging in for a store that can't succeed */
+		return EFAULT;
 	}
 	
-	//Vaild address, mask vaddr w/ PAGE_FRAME to get vpn to check for PTE inpage_table linked list.
+	//Valid address, mask vaddr w/ PAGE_FRAME to get vpn and look it up in the page table.
 	
 	vaddr_t vpn = faultaddress & PAGE_FRAME;
 	
-	struct page_entry *pg_entry;
-	pg_entry = vpn_check(vpn, as->page_table);
-	if(pg_entry == NULL){
-		err = push_pte(&(as->page_table), vpn);
+	pte_t *pte;
+	pte = pagetable_lookup(as->page_table, vpn, true);
+	if(pte == NULL){
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	err = vm_makeresident(as, region, vpn, pte);
+	if(err){
+		spinlock_release(&coremap_spinlock);
+		return err;
+	}
+
+	/*
+	 * A write to a page shared copy-on-write after fork: take a
+	 * private copy now (or just keep the frame if nobody else
+	 * holds it any more).
+	 */
+	if(faulttype != VM_FAULT_READ && (*pte & PTE_COW)){
+		err = vm_cow_break(as, pte);
 		if(err){
+			spinlock_release(&coremap_spinlock);
 			return err;
 		}
- 
-	//	bzero((void *)PADDR_TO_KVADDR(as->page_table->pas), PAGE_SIZE);
-		//else
-		//write new pte to TLB
-			
 	}
-	
-        /* Disable interrupts on this CPU while frobbing the TLB. */
+	else if(faulttype == VM_FAULT_READONLY && !(*pte & PTE_WRITE)){
+		/* Write to a page that really is read-only */
+		spinlock_release(&coremap_spinlock);
+		return EFAULT;
+	}
 
-	uint32_t ehi, elo;
-	int spl/*, tlb_return*/;
-	paddr_t tlb_pas;
-
-        spl = splhigh();
-	faultaddress &= PAGE_FRAME;
-	ehi = faultaddress;
-	if(pg_entry == NULL){
-		tlb_pas = as->page_table->pas; //what was pushed on	
-	} else{
-		tlb_pas = pg_entry->pas; //vpn check returned a page_entry
-	}
-	elo = tlb_pas | TLBLO_DIRTY | TLBLO_VALID;
-/*	tlb_return = tlb_probe(ehi,elo);
-	if(tlb_return < 0){
-	}*/
-	tlb_random(ehi, elo);
+	int index = coremap_index(PTE_PADDR(*pte));
+	KASSERT(index >= 0);
+	if(coremap[index].cm_pte == NULL && coremap[index].cm_refcount == 1){
+		/* Everyone else let go of a COW frame; it is ours to evict */
+		coremap_claim(as, vpn, pte);
+	}
+	coremap[index].cm_referenced = true;
+	*pte |= PTE_REF;
+
+	/* A store to a clean page makes it dirty; see pte_tlblo */
+	bool writable = (*pte & PTE_WRITE) && !(*pte & PTE_COW);
+	if(writable && faulttype != VM_FAULT_READ && !(*pte & PTE_DIRTY)){
+		if(coremap[index].cm_slot >= 0){
+			swap_free(coremap[index].cm_slot);
+			coremap[index].cm_slot = -1;
+			coremap_nclean--;
+		}
+		*pte |= PTE_DIRTY;
+	}
 	
+	/*
+	 * Load the TLB while still holding the lock (which also keeps
+	 * interrupts off), so a pageout cannot slip in between.
+	 */
+
+	tlb_load(vpn, pte_tlblo(*pte));
 
-	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress,as->page_table->pas);
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, PTE_PADDR(*pte));
 
-        splx(spl);
+	/* Sequential sweeps get the next few pages mapped now */
+	unsigned window = faultaround_window(region, vpn);
+	if(window > 0){
+		vm_faultaround(as, region, vpn, window);
+	}
+	else{
+		region->ra_next = vpn + PAGE_SIZE;
+	}
+
+	spinlock_release(&coremap_spinlock);
 		
 	return 0;
 }
@@ -336,6 +2067,16 @@ init_coremap(size_t ramsize, paddr_t firstpaddr){
 		coremap[i].pg_state = PAGE_FREE;
 		coremap[i].blk_state = BLOCK_CHILD;
 		coremap[i].use_state = REUSE;
+		coremap[i].cm_order = -1;
+		coremap[i].cm_next = -1;
+		coremap[i].cm_prev = -1;
+		coremap[i].cm_refcount = 0;
+		coremap[i].cm_pte = NULL;
+		coremap[i].cm_uvaddr = 0;
+		coremap[i].cm_busy = false;
+		coremap[i].cm_referenced = false;
+		coremap[i].cm_slot = -1;
+		coremap[i].cm_kheap = NULL;
 		//These are pgs already used. Must not be recycled EVER
 		if (i<pgs_used){
 			coremap[i].pg_state = PAGE_FIXED;
@@ -345,10 +2086,13 @@ init_coremap(size_t ramsize, paddr_t firstpaddr){
 		entrypaddr += sizeof(struct coremap_entry);
 	}
 
+	for (int k = 0; k < COREMAP_NORDERS; k++) {
+		freelists[k] = -1;
+	}
+	buddy_free_range(pgs_used, NUM_ENTRIES - pgs_used);
+
 	firstpaddr = coremap[pgs_used].pas;
 
     // Update the amount of available bytes left in coremap
 	bytes_left -= firstpaddr;
-
-	spinlock_release(&coremap_spinlock);
 }
@@ -0,0 +1,13 @@
+---
+name: "mlock Test"
+description: >
+  Tests mincore residency, MADV_WILLNEED and MADV_DONTNEED, and mlock
+  running into the limit on wired pages.
+tags: [vm]
+depends: [not-dumbvm-vm, shell]
+sys161:
+  ram: 8M
+---
+khu
+$ /testbin/mlocktest
+khu
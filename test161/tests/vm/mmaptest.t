@@ -0,0 +1,13 @@
+---
+name: "mmap Test"
+description: >
+  Tests anonymous and file mappings, MAP_FIXED, splitting a mapping
+  with munmap and the read-only restriction on MAP_SHARED.
+tags: [vm]
+depends: [not-dumbvm-vm, shell]
+sys161:
+  ram: 2M
+---
+khu
+$ /testbin/mmaptest
+khu
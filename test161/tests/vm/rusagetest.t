@@ -0,0 +1,13 @@
+---
+name: "getrusage Test"
+description: >
+  Tests the minor fault, major fault and maximum resident set size
+  counters reported by getrusage.
+tags: [vm]
+depends: [not-dumbvm-vm, shell]
+sys161:
+  ram: 2M
+---
+khu
+$ /testbin/rusagetest
+khu
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mlocktest.c
+ *
+ * Tests madvise, mincore, mlock and munlock: mincore residency of
+ * touched and untouched pages, MADV_WILLNEED bringing pages in,
+ * MADV_DONTNEED throwing them away, and mlock running into the
+ * kernel's limit on wired pages without disturbing the pages an
+ * earlier mlock wired.
+ *
+ * The kernel refuses MADV_DONTNEED on a range holding a wired page,
+ * which is how we tell from user level what is wired.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <test161/test161.h>
+
+/* As in sbrktest, there is no way to get this from the kernel. */
+#define PAGE_SIZE 4096
+
+/* Pages in the mincore test region */
+#define NPAGES 8
+
+/*
+ * Size of the region for the wiring test. The kernel wires at most
+ * half of physical memory, so this needs to be more than half of the
+ * RAM the test runs with; 32M covers up to 64M of RAM.
+ */
+#define BIGSIZE (32*1024*1024)
+
+/* Pages wired by the first mlock in the wiring test */
+#define NWIRED 4
+
+static
+char *
+domap(size_t len)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	/* No fault-around, so only the pages we touch come in */
+	if (madvise(p, len, MADV_RANDOM)) {
+		err(1, "madvise MADV_RANDOM");
+	}
+	return p;
+}
+
+static
+void
+dounmap(void *addr, size_t len)
+{
+	if (munmap(addr, len)) {
+		err(1, "munmap");
+	}
+}
+
+static
+void
+checkfill(const volatile char *p, size_t len, char val, const char *what)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != val) {
+			errx(1, "%s: byte %lu is %d, expected %d", what,
+			     (unsigned long)i, p[i], val);
+		}
+	}
+}
+
+/*
+ * Check mincore's view of NPAGES pages at P against EXPECT, a string
+ * of '0' and '1' with one character per page.
+ */
+static
+void
+checkcore(void *p, const char *expect, const char *what)
+{
+	char vec[NPAGES];
+	unsigned i;
+
+	if (mincore(p, NPAGES*PAGE_SIZE, vec)) {
+		err(1, "%s: mincore", what);
+	}
+	for (i = 0; i < NPAGES; i++) {
+		if ((vec[i] != 0) != (expect[i] == '1')) {
+			errx(1, "%s: page %u is %s, expected otherwise", what,
+			     i, vec[i] ? "resident" : "not resident");
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// mincore and madvise
+
+static
+void
+test_mincore(void)
+{
+	char vec[NPAGES];
+	char *p;
+
+	printf("mincore and madvise...\n");
+	p = domap(NPAGES*PAGE_SIZE);
+	checkcore(p, "00000000", "fresh mapping");
+
+	p[0] = 'a';
+	p[2*PAGE_SIZE] = 'b';
+	p[5*PAGE_SIZE] = 'c';
+	checkcore(p, "10100100", "touched pages");
+
+	if (madvise(p, NPAGES*PAGE_SIZE, MADV_WILLNEED)) {
+		err(1, "madvise MADV_WILLNEED");
+	}
+	checkcore(p, "11111111", "after MADV_WILLNEED");
+	if (p[2*PAGE_SIZE] != 'b' || p[5*PAGE_SIZE] != 'c') {
+		errx(1, "MADV_WILLNEED lost the contents of a page");
+	}
+
+	/* Discard the first half; its contents are gone for good */
+	if (madvise(p, NPAGES/2*PAGE_SIZE, MADV_DONTNEED)) {
+		err(1, "madvise MADV_DONTNEED");
+	}
+	checkcore(p, "00001111", "after MADV_DONTNEED");
+	checkfill(p, NPAGES/2*PAGE_SIZE, 0, "discarded page");
+	if (p[5*PAGE_SIZE] != 'c') {
+		errx(1, "MADV_DONTNEED discarded the wrong page");
+	}
+
+	/* Unmapped pages are an error */
+	dounmap(p + 7*PAGE_SIZE, PAGE_SIZE);
+	if (mincore(p, NPAGES*PAGE_SIZE, vec) == 0) {
+		errx(1, "mincore over an unmapped page succeeded");
+	}
+	if (errno != ENOMEM) {
+		err(1, "mincore over an unmapped page: expected ENOMEM, got");
+	}
+	if (madvise(p, NPAGES*PAGE_SIZE, MADV_DONTNEED) == 0) {
+		errx(1, "MADV_DONTNEED over an unmapped page succeeded");
+	}
+	if (errno != ENOMEM) {
+		err(1, "MADV_DONTNEED over an unmapped page: "
+		    "expected ENOMEM, got");
+	}
+
+	dounmap(p, (NPAGES-1)*PAGE_SIZE);
+}
+
+////////////////////////////////////////////////////////////
+// mlock and munlock
+
+static
+void
+test_mlock(void)
+{
+	char *p;
+	size_t wiredlen = NWIRED*PAGE_SIZE;
+
+	printf("mlock and munlock...\n");
+	p = domap(BIGSIZE);
+	memset(p, 'w', wiredlen);
+
+	if (mlock(p, wiredlen)) {
+		err(1, "mlock");
+	}
+
+	/* Wiring the whole region runs into the limit */
+	if (mlock(p, BIGSIZE) == 0) {
+		errx(1, "mlock of %d bytes succeeded", BIGSIZE);
+	}
+	if (errno != EAGAIN) {
+		err(1, "mlock past the limit: expected EAGAIN, got");
+	}
+
+	/* The failed mlock left the earlier wiring alone... */
+	if (madvise(p, wiredlen, MADV_DONTNEED) == 0) {
+		errx(1, "failed mlock unwired pages it did not wire");
+	}
+	if (errno != EINVAL) {
+		err(1, "MADV_DONTNEED of wired pages: expected EINVAL, got");
+	}
+	checkfill(p, wiredlen, 'w', "wired page");
+
+	/* ...and took back all of its own */
+	if (madvise(p + wiredlen, BIGSIZE - wiredlen, MADV_DONTNEED)) {
+		err(1, "MADV_DONTNEED past the wired pages");
+	}
+
+	/* Now the limit has room again */
+	if (mlock(p + wiredlen, wiredlen)) {
+		err(1, "mlock after the failed mlock");
+	}
+	if (munlock(p, 2*wiredlen)) {
+		err(1, "munlock");
+	}
+	if (madvise(p, 2*wiredlen, MADV_DONTNEED)) {
+		err(1, "MADV_DONTNEED after munlock");
+	}
+	checkfill(p, wiredlen, 0, "discarded page");
+
+	/* Wired pages may be unmapped without unlocking them first */
+	if (mlock(p, wiredlen)) {
+		err(1, "mlock");
+	}
+	dounmap(p, BIGSIZE);
+}
+
+int
+main(void)
+{
+	test_mincore();
+	test_mlock();
+
+	success(TEST161_SUCCESS, SECRET, "/testbin/mlocktest");
+	return 0;
+}
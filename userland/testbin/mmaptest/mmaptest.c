@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest.c
+ *
+ * Tests mmap and munmap: anonymous mappings, file mappings (including
+ * the zero fill past end of file and the privacy of writes), MAP_FIXED
+ * over an existing mapping, munmap punching a hole in the middle of a
+ * mapping, and the refusal of writable MAP_SHARED mappings.
+ *
+ * Creates and removes the file mmaptest.dat in the current directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <test161/test161.h>
+
+/* As in sbrktest, there is no way to get this from the kernel. */
+#define PAGE_SIZE 4096
+
+#define FILENAME "mmaptest.dat"
+#define FILESIZE (2*PAGE_SIZE + PAGE_SIZE/2)
+#define FILEPAGES 3
+
+static
+char
+fileval(size_t i)
+{
+	return (char)(i*7 + 3);
+}
+
+static
+void
+checkfill(const volatile char *p, size_t len, char val, const char *what)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != val) {
+			errx(1, "%s: byte %lu is %d, expected %d", what,
+			     (unsigned long)i, p[i], val);
+		}
+	}
+}
+
+static
+char *
+domap(void *addr, size_t len, int prot, int flags, int fd)
+{
+	void *p;
+
+	p = mmap(addr, len, prot, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	if (((unsigned long)p) % PAGE_SIZE != 0) {
+		errx(1, "mmap returned unaligned address %p", p);
+	}
+	if (addr != NULL && p != addr) {
+		errx(1, "MAP_FIXED mapping at %p, asked for %p", p, addr);
+	}
+	return p;
+}
+
+static
+void
+dounmap(void *addr, size_t len)
+{
+	if (munmap(addr, len)) {
+		err(1, "munmap");
+	}
+}
+
+////////////////////////////////////////////////////////////
+// anonymous mappings
+
+static
+void
+test_anon(void)
+{
+	char *p;
+
+	printf("Anonymous mapping...\n");
+	p = domap(NULL, 8*PAGE_SIZE, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANON, -1);
+	checkfill(p, 8*PAGE_SIZE, 0, "fresh anonymous page");
+	memset(p, 'x', 8*PAGE_SIZE);
+	checkfill(p, 8*PAGE_SIZE, 'x', "anonymous page");
+	dounmap(p, 8*PAGE_SIZE);
+}
+
+////////////////////////////////////////////////////////////
+// file mappings
+
+static
+int
+makefile(void)
+{
+	char buf[FILESIZE];
+	size_t i;
+	ssize_t r;
+	int fd;
+
+	for (i = 0; i < FILESIZE; i++) {
+		buf[i] = fileval(i);
+	}
+	fd = open(FILENAME, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	r = write(fd, buf, FILESIZE);
+	if (r < 0) {
+		err(1, "%s: write", FILENAME);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: short write", FILENAME);
+	}
+	return fd;
+}
+
+static
+void
+checkfile(const volatile char *p, const char *what)
+{
+	size_t i;
+
+	for (i = 0; i < FILESIZE; i++) {
+		if (p[i] != fileval(i)) {
+			errx(1, "%s: byte %lu is %d, expected %d", what,
+			     (unsigned long)i, p[i], fileval(i));
+		}
+	}
+	/* The rest of the last page lies past end of file */
+	checkfill(p + FILESIZE, FILEPAGES*PAGE_SIZE - FILESIZE, 0, what);
+}
+
+static
+void
+test_file(int fd)
+{
+	char buf[FILESIZE];
+	char *p;
+	size_t i;
+	ssize_t r;
+
+	printf("Read-only file mapping...\n");
+	p = domap(NULL, FILEPAGES*PAGE_SIZE, PROT_READ, MAP_PRIVATE, fd);
+	checkfile(p, "read-only file mapping");
+	dounmap(p, FILEPAGES*PAGE_SIZE);
+
+	printf("Private writable file mapping...\n");
+	p = domap(NULL, FILEPAGES*PAGE_SIZE, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE, fd);
+	checkfile(p, "writable file mapping");
+	memset(p, 'y', FILEPAGES*PAGE_SIZE);
+	checkfill(p, FILEPAGES*PAGE_SIZE, 'y', "written file mapping");
+	dounmap(p, FILEPAGES*PAGE_SIZE);
+
+	/* Writes to a private mapping must not reach the file */
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", FILENAME);
+	}
+	r = read(fd, buf, FILESIZE);
+	if (r < 0) {
+		err(1, "%s: read", FILENAME);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: short read", FILENAME);
+	}
+	for (i = 0; i < FILESIZE; i++) {
+		if (buf[i] != fileval(i)) {
+			errx(1, "%s: private mapping changed the file "
+			     "at byte %lu", FILENAME, (unsigned long)i);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// MAP_FIXED
+
+static
+void
+test_fixed(void)
+{
+	char *p;
+
+	printf("MAP_FIXED over an existing mapping...\n");
+	p = domap(NULL, 4*PAGE_SIZE, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANON, -1);
+	memset(p, 'a', 4*PAGE_SIZE);
+
+	/* Replace the middle two pages */
+	domap(p + PAGE_SIZE, 2*PAGE_SIZE, PROT_READ|PROT_WRITE,
+	      MAP_PRIVATE|MAP_ANON|MAP_FIXED, -1);
+	checkfill(p, PAGE_SIZE, 'a', "page before MAP_FIXED");
+	checkfill(p + PAGE_SIZE, 2*PAGE_SIZE, 0, "MAP_FIXED page");
+	checkfill(p + 3*PAGE_SIZE, PAGE_SIZE, 'a', "page after MAP_FIXED");
+
+	memset(p + PAGE_SIZE, 'b', 2*PAGE_SIZE);
+	checkfill(p, PAGE_SIZE, 'a', "page before MAP_FIXED");
+	checkfill(p + PAGE_SIZE, 2*PAGE_SIZE, 'b', "MAP_FIXED page");
+	checkfill(p + 3*PAGE_SIZE, PAGE_SIZE, 'a', "page after MAP_FIXED");
+
+	dounmap(p, 4*PAGE_SIZE);
+}
+
+////////////////////////////////////////////////////////////
+// munmap splitting a mapping
+
+static volatile char *hole;
+
+static
+void
+touchhole(void)
+{
+	hole[0] = 'z';
+	/* Not reached */
+	_exit(0);
+}
+
+static
+void
+expect_segfault(void (*func)(void))
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		func();	// This exits
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFSIGNALED(status)) {
+		errx(1, "child exited, expected segfault");
+	}
+	if (WTERMSIG(status) != 11) {
+		errx(1, "child: Signal %d", WTERMSIG(status));
+	}
+}
+
+static
+void
+test_split(void)
+{
+	char *p;
+	char vec;
+
+	printf("munmap splitting a mapping...\n");
+	p = domap(NULL, 5*PAGE_SIZE, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANON, -1);
+	memset(p, 'c', 5*PAGE_SIZE);
+
+	hole = p + 2*PAGE_SIZE;
+	dounmap(p + 2*PAGE_SIZE, PAGE_SIZE);
+	checkfill(p, 2*PAGE_SIZE, 'c', "page below the hole");
+	checkfill(p + 3*PAGE_SIZE, 2*PAGE_SIZE, 'c', "page above the hole");
+
+	if (mincore(p + 2*PAGE_SIZE, PAGE_SIZE, &vec) == 0) {
+		errx(1, "mincore on the hole succeeded");
+	}
+	if (errno != ENOMEM) {
+		err(1, "mincore on the hole: expected ENOMEM, got");
+	}
+	expect_segfault(touchhole);
+
+	/* The hole can be filled again */
+	domap(p + 2*PAGE_SIZE, PAGE_SIZE, PROT_READ|PROT_WRITE,
+	      MAP_PRIVATE|MAP_ANON|MAP_FIXED, -1);
+	checkfill(p + 2*PAGE_SIZE, PAGE_SIZE, 0, "page refilling the hole");
+	checkfill(p, 2*PAGE_SIZE, 'c', "page below the hole");
+	checkfill(p + 3*PAGE_SIZE, 2*PAGE_SIZE, 'c', "page above the hole");
+
+	/* Both halves and the new page go in one call */
+	dounmap(p, 5*PAGE_SIZE);
+}
+
+////////////////////////////////////////////////////////////
+// MAP_SHARED
+
+static
+void
+test_shared(int fd)
+{
+	char *p;
+
+	printf("MAP_SHARED...\n");
+	p = mmap(NULL, FILEPAGES*PAGE_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_SHARED, fd, 0);
+	if (p != MAP_FAILED) {
+		errx(1, "writable MAP_SHARED mapping succeeded");
+	}
+	if (errno != ENOTSUP) {
+		err(1, "writable MAP_SHARED: expected ENOTSUP, got");
+	}
+
+	/* Read-only it is allowed */
+	p = domap(NULL, FILEPAGES*PAGE_SIZE, PROT_READ, MAP_SHARED, fd);
+	checkfile(p, "read-only MAP_SHARED mapping");
+	dounmap(p, FILEPAGES*PAGE_SIZE);
+}
+
+int
+main(void)
+{
+	int fd;
+
+	test_anon();
+	fd = makefile();
+	test_file(fd);
+	test_fixed();
+	test_split();
+	test_shared(fd);
+	close(fd);
+	if (remove(FILENAME)) {
+		err(1, "%s: remove", FILENAME);
+	}
+
+	success(TEST161_SUCCESS, SECRET, "/testbin/mmaptest");
+	return 0;
+}
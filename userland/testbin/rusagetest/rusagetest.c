@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * rusagetest.c
+ *
+ * Tests the paging counters getrusage reports. Touching fresh
+ * anonymous pages must count as minor faults and raise the maximum
+ * resident set size; reading in pages of a file mapping must count as
+ * major faults.
+ *
+ * Creates and removes the file rusagetest.dat in the current directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <test161/test161.h>
+
+/* As in sbrktest, there is no way to get this from the kernel. */
+#define PAGE_SIZE 4096
+
+#define FILENAME "rusagetest.dat"
+
+/* Pages touched in each test */
+#define NPAGES 64
+
+static
+void
+getusage(struct rusage *ru)
+{
+	if (getrusage(RUSAGE_SELF, ru)) {
+		err(1, "getrusage");
+	}
+}
+
+static
+char *
+domap(int prot, int flags, int fd)
+{
+	void *p;
+
+	p = mmap(NULL, NPAGES*PAGE_SIZE, prot, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	/* No fault-around, so every page we touch is a fault */
+	if (madvise(p, NPAGES*PAGE_SIZE, MADV_RANDOM)) {
+		err(1, "madvise");
+	}
+	return p;
+}
+
+static
+void
+test_anon(void)
+{
+	struct rusage before, after;
+	volatile char *p;
+	unsigned i;
+
+	printf("Anonymous faults...\n");
+	p = domap(PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1);
+
+	getusage(&before);
+	for (i = 0; i < NPAGES; i++) {
+		p[i*PAGE_SIZE] = i;
+	}
+	getusage(&after);
+
+	if (after.ru_minflt < before.ru_minflt + NPAGES) {
+		errx(1, "ru_minflt went from %lu to %lu over %d faults",
+		     (unsigned long)before.ru_minflt,
+		     (unsigned long)after.ru_minflt, NPAGES);
+	}
+	if (after.ru_maxrss <= before.ru_maxrss) {
+		errx(1, "ru_maxrss stayed at %lu KB after faulting in %d KB",
+		     (unsigned long)after.ru_maxrss, NPAGES*PAGE_SIZE/1024);
+	}
+	if (munmap((void *)p, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+}
+
+static
+void
+test_file(void)
+{
+	struct rusage before, after;
+	char buf[PAGE_SIZE];
+	volatile char *p;
+	unsigned i;
+	int fd;
+
+	printf("File faults...\n");
+	memset(buf, 'f', sizeof(buf));
+	fd = open(FILENAME, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	for (i = 0; i < NPAGES; i++) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			err(1, "%s: write", FILENAME);
+		}
+	}
+	p = domap(PROT_READ, MAP_PRIVATE, fd);
+
+	getusage(&before);
+	for (i = 0; i < NPAGES; i++) {
+		if (p[i*PAGE_SIZE] != 'f') {
+			errx(1, "%s: wrong data in page %u", FILENAME, i);
+		}
+	}
+	getusage(&after);
+
+	if (after.ru_majflt < before.ru_majflt + NPAGES) {
+		errx(1, "ru_majflt went from %lu to %lu over %d faults",
+		     (unsigned long)before.ru_majflt,
+		     (unsigned long)after.ru_majflt, NPAGES);
+	}
+	if (munmap((void *)p, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	close(fd);
+	if (remove(FILENAME)) {
+		err(1, "%s: remove", FILENAME);
+	}
+}
+
+int
+main(void)
+{
+	test_anon();
+	test_file();
+
+	success(TEST161_SUCCESS, SECRET, "/testbin/rusagetest");
+	return 0;
+}